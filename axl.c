@@ -65,6 +65,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <err.h>
 #include <ctype.h>
@@ -73,6 +74,8 @@
 #include <curl/curl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "axl.h"
 
 const char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -91,6 +94,14 @@ const char empty[1] = "";
 
 static struct xml_namespace_s nullns = { 0 };
 
+static int xml_depth_max;       // Parsers fail on elements nested deeper than this, 0 for no limit
+
+void
+xml_max_depth (int depth)
+{                               // Set limit on nesting of elements when parsing XML
+   xml_depth_max = depth;
+}
+
 static void *
 xml_alloc (size_t s)
 {
@@ -110,19 +121,100 @@ xml_free (void *s)
 }
 
 static int
-strcmp_l (int al, const char *a, int bl, const char *b)
+xml_owned (xml_root_t t, const void *s)
+{                               // String is in storage owned by the tree (in-situ parse buffer) rather than separately allocated
+   return t && t->buffer && (const char *) s >= t->buffer && (const char *) s < t->buffer + t->bufferlen;
+}
+
+static void *
+xml_free_s (xml_root_t t, void *s)
+{                               // Free a string or node from a tree
+   if (t && t->arena)
+      return NULL;              // Released with the arena when the tree is deleted
+   if (xml_owned (t, s))
+      return NULL;
+   return xml_free (s);
+}
+
+#define	XML_ARENA_MIN	4096    // First arena chunk, including the tree itself
+#define	XML_ARENA_MAX	1048576 // Chunks double up to this
+
+struct xml_arena_s
+{                               // Chunk of storage for a tree
+   xml_arena_t next;
+   size_t size,
+     used;
+   char data[] __attribute__ ((aligned (8)));
+};
+
+static xml_arena_t
+arena_chunk (size_t size, xml_arena_t next)
 {
-   if (!al && !bl)
-      return 0;
-   if (!a || al < bl)
-      return -1;
-   if (!b || bl > al)
-      return 1;
-   if (!al)
-      return 0;
-   return memcmp (a, b, al);
+   xml_arena_t a = malloc (sizeof (*a) + size);
+   if (!a)
+      errx (1, "malloc at line %d", __LINE__);
+   a->next = next;
+   a->size = size;
+   a->used = 0;
+   return a;
+}
+
+static void *
+arena_alloc (xml_arena_t * h, size_t s, size_t align)
+{                               // Allocate from a list of arena chunks, not zeroed
+   xml_arena_t a = *h;
+   size_t o = a ? (a->used + align - 1) & ~(align - 1) : 0;
+   if (!a || o + s > a->size)
+   {
+      size_t size = !a ? XML_ARENA_MIN : a->size < XML_ARENA_MAX ? a->size * 2 : a->size;
+      if (a && s > size / 4)
+      {                         // Large, so its own chunk, after the current one which may still have space
+         a->next = arena_chunk (s, a->next);
+         a->next->used = s;
+         return a->next->data;
+      }
+      if (s > size)
+         size = s;
+      a = *h = arena_chunk (size, a);
+      o = 0;
+   }
+   a->used = o + s;
+   return a->data + o;
+}
+
+static void
+arena_free (xml_arena_t a)
+{
+   while (a)
+   {
+      xml_arena_t n = a->next;
+      free (a);
+      a = n;
+   }
+}
+
+static void *
+xml_alloc_t (xml_root_t t, size_t s)
+{                               // Allocate a node for a tree, zeroed
+   if (!t || !t->arena)
+      return xml_alloc (s);
+   return memset (arena_alloc (&t->arena, s, 8), 0, s);
+}
+
+static unsigned int
+xml_hash (int l, const char *s)
+{                               // FNV-1a hash of l bytes
+   unsigned int h = 2166136261U;
+   while (l--)
+      h = (h ^ (unsigned char) *s++) * 16777619U;
+   return h;
 }
 
+static xml_namespacelist_t namespace_find (xml_root_t t, unsigned int l, const char *uri);
+static xml_t tree_new (const char *name, int arena);
+static xml_attribute_t attribute_set (xml_t e, xml_namespace_t namespace, int namel, const char *name, int contentl,
+                                      const char *content, int insitu);
+
 static char *
 xml_dup_l (int l, const char *s)
 {
@@ -143,27 +235,109 @@ xml_dup (const char *s)
    return xml_dup_l (strlen (s), s);
 }
 
-// This was added for saving element filenames, but could be used more generally
 static char *
-savestring (const char *s, int length, xml_root_t t)
-{
-   xml_stringlist_t p;
+xml_dup_t (xml_root_t t, int l, const char *s)
+{                               // Copy a string for a tree
+   if (!t || !t->arena || !s || !l)
+      return xml_dup_l (l, s);
+   char *m = arena_alloc (&t->arenatext, l + 1, 1);     // Apart from nodes, so nodes are packed together
+   memcpy (m, s, l);
+   m[l] = 0;
+   return m;
+}
+
+struct xml_intern_s
+{                               // Interned name, the name string is stored in the entry
+   xml_intern_t next;           // Next in hash chain
+   xml_name_t other;            // Same name in another tree, when moving between trees
+   unsigned int hash;
+   int len;
+   char name[];
+};
+
+#define	name_entry(n)	((xml_intern_t)((n)-offsetof(struct xml_intern_s,name)))
+
+static xml_name_t
+name_find (xml_root_t t, int l, const char *s)
+{                               // Find name if interned in tree, else NULL
    if (!s)
       return NULL;
-   if (!*s)
+   if (!l)
       return (char *) empty;
-   for (p = t->strings; p && (p->length != length || strncmp (p->string, s, length)); p = p->next);
-   if (p)
-      return p->string;
-   p = xml_alloc (sizeof (*p));
-   p->string = xml_alloc (length + 1);
-   p->length = length;
-   memmove (p->string, s, length);
-   p->next = t->strings;
-   t->strings = p;
-   return p->string;
+   if (!t->intern)
+      return NULL;
+   unsigned int h = xml_hash (l, s);
+   xml_intern_t i;
+   for (i = t->intern[h & (t->internn - 1)]; i; i = i->next)
+      if (i->hash == h && i->len == l && !memcmp (i->name, s, l))
+         return i->name;
+   return NULL;
+}
+
+static xml_name_t
+name_intern (xml_root_t t, int l, const char *s)
+{                               // Name stored once per tree, never freed until the tree is deleted
+   if (!s)
+      return NULL;
+   if (!l)
+      return (char *) empty;
+   unsigned int h = xml_hash (l, s);
+   xml_intern_t i;
+   if (t->intern)
+      for (i = t->intern[h & (t->internn - 1)]; i; i = i->next)
+         if (i->hash == h && i->len == l && !memcmp (i->name, s, l))
+            return i->name;
+   if (t->interned >= t->internn)
+   {                            // Grow and rehash
+      int n = (t->internn ? : 8) * 2;
+      xml_intern_t *new = calloc (n, sizeof (*new));
+      if (!new)
+         errx (1, "malloc at line %d", __LINE__);
+      int b;
+      for (b = 0; b < t->internn; b++)
+         while ((i = t->intern[b]))
+         {
+            t->intern[b] = i->next;
+            i->next = new[i->hash & (n - 1)];
+            new[i->hash & (n - 1)] = i;
+         }
+      free (t->intern);
+      t->intern = new;
+      t->internn = n;
+   }
+   i = t->arena ? arena_alloc (&t->arenatext, sizeof (*i) + l + 1, 8) : malloc (sizeof (*i) + l + 1);
+   if (!i)
+      errx (1, "malloc at line %d", __LINE__);
+   i->other = NULL;
+   i->hash = h;
+   i->len = l;
+   memcpy (i->name, s, l);
+   i->name[l] = 0;
+   i->next = t->intern[h & (t->internn - 1)];
+   t->intern[h & (t->internn - 1)] = i;
+   t->interned++;
+   return i->name;
+}
+
+static void
+name_free (xml_root_t t)
+{                               // Free interned names
+   if (!t->arena)
+   {
+      int b;
+      for (b = 0; b < t->internn; b++)
+         while (t->intern[b])
+         {
+            xml_intern_t i = t->intern[b];
+            t->intern[b] = i->next;
+            free (i);
+         }
+   }
+   free (t->intern);
 }
 
+#define	XML_PREFIX_HASH	64      // Size of in scope prefix hash in parsers, power of 2
+
 #ifdef	EXPAT
 typedef struct xml_namespacestack_s
 {
@@ -172,62 +346,496 @@ typedef struct xml_namespacestack_s
    xml_t base;
 } *xml_namespacestack_t;
 
-typedef struct xml_parser_s
+struct xml_build_s
+{                               // Content being built for an open element, buffer reused for later elements at this depth
+   char *text;
+   size_t len,
+     alloc;
+};
+
+struct xml_parser_s
 {
    xml_root_t tree;             // Tree
    xml_t here;                  // Where we are in parsing
    xml_namespacestack_t namespacestack;
+   xml_namespacelist_t prefix[XML_PREFIX_HASH]; // In scope prefixes, hashed, most recent first in each chain
    const char *current_file;
    xml_callback_t *callback;    // called at end of each top level element
    int line_offset;
    XML_Parser parser;
-} xml_parser_t;
+   unsigned char start:1;       // At start of data (when fed in parts)
+   unsigned char arena:1;       // Trees allocated in an arena
+   struct xml_build_s *content; // Content being built for each open element
+   int depth,
+     contenta;
+};
 #endif
 
 #ifndef	EXPAT
+static int
+strcmp_l (int al, const char *a, int bl, const char *b)
+{
+   if (!al && !bl)
+      return 0;
+   if (!a || al < bl)
+      return -1;
+   if (!b || bl > al)
+      return 1;
+   if (!al)
+      return 0;
+   return memcmp (a, b, al);
+}
+
+// Scan plain ASCII text for the next delimiter, used by the native parser to skip runs of text in bulk.
+// Returns first byte that is a, b, c, a null, or not ASCII. Sets *lines to the number of new lines skipped and *nl to the last one.
+// The vector versions only use aligned loads so never read past the page holding the terminating null.
+typedef const unsigned char *xml_scan_func (const unsigned char *p, unsigned char a, unsigned char b, unsigned char c, int *lines,
+                                            const unsigned char **nl);
+
+static const unsigned char *
+scan_scalar (const unsigned char *p, unsigned char a, unsigned char b, unsigned char c, int *lines, const unsigned char **nl)
+{
+   int n = 0;
+   const unsigned char *last = NULL;
+   while (*p && *p < 0x80 && *p != a && *p != b && *p != c)
+   {
+      if (*p == '\n')
+      {
+         n++;
+         last = p;
+      }
+      p++;
+   }
+   *lines = n;
+   *nl = last;
+   return p;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#include <stdint.h>
+#define	SCAN_SIMD
+
+static const unsigned char *
+scan_sse2 (const unsigned char *p, unsigned char a, unsigned char b, unsigned char c, int *lines, const unsigned char **nl)
+{
+   const __m128i va = _mm_set1_epi8 (a),
+      vb = _mm_set1_epi8 (b),
+      vc = _mm_set1_epi8 (c),
+      vn = _mm_set1_epi8 ('\n'),
+      vz = _mm_setzero_si128 ();
+   const unsigned char *s = (const unsigned char *) ((uintptr_t) p & ~(uintptr_t) 15);
+   unsigned int skip = p - s;   // Bytes before p in first block
+   int n = 0;
+   const unsigned char *last = NULL;
+   while (1)
+   {
+      __m128i v = _mm_load_si128 ((const __m128i *) s);
+      unsigned int stop = _mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, va), _mm_cmpeq_epi8 (v, vb)),
+                                                           _mm_or_si128 (_mm_cmpeq_epi8 (v, vc), _mm_cmpeq_epi8 (v, vz))))
+         | _mm_movemask_epi8 (v);       // Top bit is non ASCII
+      unsigned int lf = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, vn));
+      stop = (stop >> skip) << skip;
+      lf = (lf >> skip) << skip;
+      skip = 0;
+      if (stop)
+         lf &= (1U << __builtin_ctz (stop)) - 1;
+      if (lf)
+      {
+         n += __builtin_popcount (lf);
+         last = s + 31 - __builtin_clz (lf);
+      }
+      if (stop)
+      {
+         *lines = n;
+         *nl = last;
+         return s + __builtin_ctz (stop);
+      }
+      s += 16;
+   }
+}
+
+__attribute__ ((target ("avx2")))
+static const unsigned char *
+scan_avx2 (const unsigned char *p, unsigned char a, unsigned char b, unsigned char c, int *lines, const unsigned char **nl)
+{
+   const __m256i va = _mm256_set1_epi8 (a),
+      vb = _mm256_set1_epi8 (b),
+      vc = _mm256_set1_epi8 (c),
+      vn = _mm256_set1_epi8 ('\n'),
+      vz = _mm256_setzero_si256 ();
+   const unsigned char *s = (const unsigned char *) ((uintptr_t) p & ~(uintptr_t) 31);
+   unsigned int skip = p - s;   // Bytes before p in first block
+   int n = 0;
+   const unsigned char *last = NULL;
+   while (1)
+   {
+      __m256i v = _mm256_load_si256 ((const __m256i *) s);
+      unsigned int stop =
+         _mm256_movemask_epi8 (_mm256_or_si256
+                               (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, va), _mm256_cmpeq_epi8 (v, vb)),
+                                _mm256_or_si256 (_mm256_cmpeq_epi8 (v, vc), _mm256_cmpeq_epi8 (v, vz)))) | _mm256_movemask_epi8 (v);
+      unsigned int lf = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, vn));
+      if (skip)
+      {                         // Shift of 32 is undefined, but skip is at most 31 here
+         stop = (stop >> skip) << skip;
+         lf = (lf >> skip) << skip;
+         skip = 0;
+      }
+      if (stop)
+         lf &= (stop & -stop) - 1;      // Only new lines before the stop
+      if (lf)
+      {
+         n += __builtin_popcount (lf);
+         last = s + 31 - __builtin_clz (lf);
+      }
+      if (stop)
+      {
+         *lines = n;
+         *nl = last;
+         return s + __builtin_ctz (stop);
+      }
+      s += 32;
+   }
+}
+
+static xml_scan_func scan_init;
+static xml_scan_func *xml_scan = scan_init;
+
+static const unsigned char *
+scan_init (const unsigned char *p, unsigned char a, unsigned char b, unsigned char c, int *lines, const unsigned char **nl)
+{                               // Pick scanner on first use
+   __builtin_cpu_init ();
+   if (__builtin_cpu_supports ("avx2"))
+      xml_scan = scan_avx2;
+   else if (__builtin_cpu_supports ("sse2"))
+      xml_scan = scan_sse2;
+   else
+      xml_scan = scan_scalar;
+   return xml_scan (p, a, b, c, lines, nl);
+}
+#else
+static xml_scan_func *xml_scan = scan_scalar;
+#endif
+
+#define	NAME_CHAR	1       // NameChar
+#define	NAME_START	2       // NameStartChar
+#define	NAME_UTF8	4       // Non ASCII, check in full
+static const unsigned char namechar[256] = {    // https://www.w3.org/TR/xml/#NT-NameChar for ASCII
+   [':'] = NAME_CHAR + NAME_START,['_'] = NAME_CHAR + NAME_START,['A' ... 'Z'] = NAME_CHAR + NAME_START,['a' ... 'z'] =
+      NAME_CHAR + NAME_START,['-'] = NAME_CHAR,['.'] = NAME_CHAR,['0' ... '9'] = NAME_CHAR,[0x80 ... 0xFF] = NAME_UTF8
+};
+
+static inline int
+utf8_len (const unsigned char *p)
+{                               // Length of character if valid UTF-8 in shortest form (so decoding and encoding would not change it), else 0
+   if (p[0] < 0x80)
+      return 1;
+   if (p[0] >= 0xC2 && p[0] <= 0xDF)
+      return (p[1] & 0xC0) == 0x80 ? 2 : 0;
+   if (p[0] >= 0xE0 && p[0] <= 0xEF)
+      return (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80 && (p[0] != 0xE0 || p[1] >= 0xA0) ? 3 : 0;
+   if (p[0] >= 0xF0 && p[0] <= 0xF7)
+      return (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80 && (p[3] & 0xC0) == 0x80 && (p[0] != 0xF0 || p[1] >= 0x90) ? 4 : 0;
+   return 0;
+}
+
 typedef void xml_error_func (const char *filename, int line, int character, const char *error, const unsigned char *posn);
 
-static xml_t
-xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail)
-{                               // Parse null terminated XML data
-   // https://www.w3.org/TR/xml/#NT-document
-   xml_t root = xml_tree_new (NULL);
+struct xml_frame_s
+{                               // Open element during parse
+   xml_t n;                     // The element
+   size_t tag;                  // Offset of tag (including prefix) in scratch, for checking ETag
+   int tagl;
+   size_t base;                 // Offset of content in scratch
+   int nssp;                    // Name space stack position to go back to at end of element
+   const unsigned char *cstart; // Start of content in input (used if in-situ)
+   unsigned long long select;   // Projection, paths this element is part way along
+   unsigned char decoded:1;     // Content is not simply the input text
+   unsigned char kids:1;        // Has child elements
+   unsigned char whole:1;       // Projection, element and all within it wanted
+};
+
+struct xml_step_s
+{                               // Projection, one step of a path
+   const char *prefix;          // NULL for any name space
+   const char *name;            // "*" for any
+   int prefixl,
+     namel;
+};
+
+struct xml_select_s
+{                               // Projection, paths wanted
+   int n;
+   unsigned long long all;      // All paths
+   struct xml_path_s
+   {
+      int steps;                // Elements, the first being the root
+      struct xml_step_s *step;
+      struct xml_step_s attribute;      // Final attribute, name NULL if none
+   } *path;
+};
+
+enum
+{                               // Parser state
+   XML_PARSE_START,             // Start of document, XML declaration allowed
+   XML_PARSE_PROLOG,            // Before root element
+   XML_PARSE_CONTENT,           // Within root element
+   XML_PARSE_EPILOG,            // After root element
+   XML_PARSE_ERROR,             // Failed, error reported
+};
+
+struct xml_parser_s
+{                               // Native parser, state held here between parts of data fed in
+   xml_t root;                  // Tree being built
+   const char *filename;        // For errors
+   xml_error_func *fail;        // Report errors
+   xml_callback_t *callback;    // If set, called with each complete document, which is then deleted
+   struct xml_select_s *select; // If set, only parse elements on these paths
+   unsigned char state;         // XML_PARSE_...
+   unsigned char insitu:1;      // Whole input is writable and owned by tree, see xml_parse
+   unsigned char doctype:1;     // Have had DOCTYPE
+   unsigned char arena:1;       // Trees allocated in an arena
+   unsigned char pull:1;        // Pull reader, stop after each event, see xml_reader_next
+   unsigned char empty:1;       // Pull reader, START was an EmptyElemTag so END to follow
+   unsigned char event;         // Pull reader, XML_READER_... event from last token
+   int capture;                 // Pull reader, depth of element being built as a subtree, no events within it
+   xml_t current;               // Pull reader, element for event
+   int line,                    // Position for errors
+     character;
    struct
-   {                            // Name space stack during parse
+   {                            // Name space stack
       int tagl;
-      const unsigned char *tag;
+      size_t tag;               // Offset of prefix in nsb
       xml_namespace_t namespace;
-   } *nss = NULL;
-   int nssp = 0,
-      nssn = 0;
-   void ns_stack (int tagl, const unsigned char *tag, int namespacel, char *namespace)
-   {                            // Add to stack
-      if (nssp + 1 > nssn)
-         nss = realloc (nss, sizeof (*nss) * (++nssn));
-      nss[nssp].tagl = tagl;
-      nss[nssp].tag = tag;
-      nss[nssp].namespace = xml_namespace_l (root, tagl, (const char *) tag, namespacel, (const char *) namespace);
-      nssp++;
-   }
-   ns_stack (3, (unsigned char *) "xml", 36, "http://www.w3.org/XML/1998/namespace");
-   xml_namespace_t ns_find (int tagl, const unsigned char *tag)
-   {                            // Find namespace from stack
-      int p = nssp;
-      while (p--)
-         if (!strcmp_l (nss[p].tagl, (const char *) nss[p].tag, tagl, (const char *) tag))
-            return nss[p].namespace;
+      unsigned int hash;        // Hash of prefix
+      int next;                 // Index + 1 of next in hash chain
+   } *nss;
+   int nssp,
+     nssn;
+   int nsh[XML_PREFIX_HASH];    // Name space stack hashed by prefix, index + 1 of most recent in each chain
+   char *nsb;                   // Name space prefixes for stack
+   size_t nsbl,
+     nsba;
+   char *buf;                   // Scratch for content and attribute values, used as a stack and reused for whole parse
+   size_t bufl,
+     bufa;
+   struct xml_frame_s *stack;   // Open elements
+   int depth,
+     stacka;
+   unsigned char *data;         // Input, null terminated
+   size_t datal,                // Length of data (if fed in parts)
+     dataa,                     // Allocated data (if fed in parts)
+     used,                      // How much data parsed
+     posn,                      // Last character parsed, for errors
+     cut,                       // End of data we can parse so far (if fed in parts)
+     stop;                      // End of content to parse, as data runs on beyond it (if parsing part of root content)
+};
+
+static void
+parser_ns_push (xml_parser_t x, int tagl, const unsigned char *tag, xml_namespace_t namespace)
+{                               // Add to name space stack
+   if (x->nssp + 1 > x->nssn)
+   {
+      x->nssn = x->nssn * 2 + 8;
+      x->nss = realloc (x->nss, sizeof (*x->nss) * x->nssn);
+      if (!x->nss)
+         errx (1, "malloc at line %d", __LINE__);
+   }
+   if (x->nsbl + tagl > x->nsba)
+   {
+      x->nsba = (x->nsbl + tagl) * 2;
+      x->nsb = realloc (x->nsb, x->nsba);
+      if (!x->nsb)
+         errx (1, "malloc at line %d", __LINE__);
+   }
+   x->nss[x->nssp].tagl = tagl;
+   x->nss[x->nssp].tag = x->nsbl;
+   x->nss[x->nssp].namespace = namespace;
+   int *h = &x->nsh[(x->nss[x->nssp].hash = xml_hash (tagl, (const char *) tag)) & (XML_PREFIX_HASH - 1)];
+   x->nss[x->nssp].next = *h;
+   *h = ++x->nssp;
+   if (tagl)
+      memcpy (x->nsb + x->nsbl, tag, tagl);
+   x->nsbl += tagl;
+}
+
+static void
+parser_ns (xml_parser_t x, int tagl, const unsigned char *tag, int namespacel, const char *namespace)
+{                               // Define name space in tree and add to name space stack
+   parser_ns_push (x, tagl, tag, xml_namespace_l (x->root, tagl, (const char *) tag, namespacel, namespace));
+}
+
+static void
+parser_ns_pop (xml_parser_t x, int nssp)
+{                               // Back to name space stack position
+   if (nssp >= x->nssp)
+      return;
+   x->nsbl = x->nss[nssp].tag;
+   while (x->nssp > nssp)
+   {                            // Most recent first, so always the head of its chain
+      x->nssp--;
+      x->nsh[x->nss[x->nssp].hash & (XML_PREFIX_HASH - 1)] = x->nss[x->nssp].next;
+   }
+}
+
+static xml_namespace_t
+parser_ns_find (xml_parser_t x, int tagl, const unsigned char *tag)
+{                               // Find namespace from stack
+   int p;
+   for (p = x->nsh[xml_hash (tagl, (const char *) tag) & (XML_PREFIX_HASH - 1)]; p; p = x->nss[p - 1].next)
+      if (!strcmp_l (x->nss[p - 1].tagl, x->nsb + x->nss[p - 1].tag, tagl, (const char *) tag))
+         return x->nss[p - 1].namespace;
+   return NULL;
+}
+
+static void
+parser_reset (xml_parser_t x)
+{                               // Start a new document
+   x->root = tree_new (NULL, x->arena);
+   x->state = XML_PARSE_START;
+   x->doctype = 0;
+   x->nssp = 0;
+   x->nsbl = 0;
+   memset (x->nsh, 0, sizeof (x->nsh));
+   parser_ns_push (x, 3, (unsigned char *) "xml", x->root->tree->namespacelist->namespace);    // xml_tree_new defines it first
+}
+
+static void
+parser_init (xml_parser_t x, const char *filename, xml_error_func * fail, xml_callback_t * callback)
+{
+   memset (x, 0, sizeof (*x));
+   x->filename = filename;
+   x->fail = fail;
+   x->callback = callback;
+   parser_reset (x);
+}
+
+static void
+parser_reuse (xml_parser_t x)
+{                               // Start a new document, keeping working storage
+   struct xml_parser_s k = *x;
+   memset (x, 0, sizeof (*x));
+   x->filename = k.filename;
+   x->fail = k.fail;
+   x->callback = k.callback;
+   x->arena = k.arena;
+   x->nss = k.nss;
+   x->nssn = k.nssn;
+   x->nsb = k.nsb;
+   x->nsba = k.nsba;
+   x->buf = k.buf;
+   x->bufa = k.bufa;
+   x->stack = k.stack;
+   x->stacka = k.stacka;
+   parser_reset (x);
+}
+
+static xml_t
+parser_tree (xml_parser_t x)
+{                               // Returning tree (NULL if error or all passed to callback)
+   xml_t root = x->root;
+   if (x->state == XML_PARSE_ERROR)
+      root = NULL;              // Already deleted
+   else if (x->callback)
+   {                            // Unused
+      xml_tree_delete (root);
+      root = NULL;
+   }
+   x->root = NULL;
+   return root;
+}
+
+static void
+parser_free (xml_parser_t x)
+{                               // Free working storage
+   free (x->nss);
+   free (x->nsb);
+   free (x->buf);
+   free (x->stack);
+   if (x->dataa)
+      free (x->data);
+}
+
+static xml_t
+parser_end (xml_parser_t x)
+{                               // Free working storage, returning tree (NULL if error or all passed to callback)
+   xml_t root = parser_tree (x);
+   parser_free (x);
+   return root;
+}
+
+static inline void
+parser_addb (xml_parser_t x, size_t l, const void *s)
+{                               // Add bytes to scratch, always leaving space for a null
+   if (x->bufl + l + 1 > x->bufa)
+   {
+      x->bufa = (x->bufl + l + 1) * 2;
+      x->buf = realloc (x->buf, x->bufa);
+      if (!x->buf)
+         errx (1, "malloc at line %d", __LINE__);
+   }
+   if (l)
+      memcpy (x->buf + x->bufl, s, l);
+   x->bufl += l;
+}
+
+static const unsigned char *
+xml_skip_markup (const unsigned char *p, int *depth)
+{                               // Skip markup at < without checking it, respecting CDATA, comments, PIs and quotes
+   // Returns its final >, or NULL if not found or not something we can skip, adjusting depth for STag and ETag
+   if (p[1] == '/')
+   {
+      --*depth;
+      return (const unsigned char *) strchr ((const char *) p, '>');
+   }
+   if (p[1] == '?')
+      p = (const unsigned char *) strstr ((const char *) p + 2, "?>");
+   else if (!strncmp ((const char *) p, "<!--", 4))
+      p = (const unsigned char *) strstr ((const char *) p + 4, "-->");
+   else if (!strncmp ((const char *) p, "<![CDATA[", 9))
+      p = (const unsigned char *) strstr ((const char *) p + 9, "]]>");
+   else if (p[1] == '!')
       return NULL;
+   else
+   {                            // STag or EmptyElemTag
+      p = (const unsigned char *) strpbrk ((const char *) p, "'\">");
+      while (p && *p != '>')
+      {
+         p = (const unsigned char *) strchr ((const char *) p + 1, *p);
+         if (p)
+            p = (const unsigned char *) strpbrk ((const char *) p + 1, "'\">");
+      }
+      if (p && p[-1] != '/')
+         ++*depth;
+      return p;
    }
-   const unsigned char *p = xml,
-      *posn = xml;
-   int line = 0,
-      character = 0;
-   const char *er = NULL;       // Error
-   if (!p)
+   if (p)
+      p = (const unsigned char *) strchr ((const char *) p, '>');
+   return p;
+}
+
+static void
+parser_run (xml_parser_t x, int final)
+{                               // Parse the data we have, if not final then stopping before any token that may be incomplete
+   // https://www.w3.org/TR/xml/#NT-document
+   // Tokens are only parsed up to the last > we have, so an incomplete token runs in to the (temporary) end of data
+   if (x->state == XML_PARSE_ERROR)
+      return;
+   const unsigned char *p = x->data + x->used,
+      *posn = x->data + x->posn;
+   const unsigned char *end = NULL;     // Temporary end of data, if not final
+   unsigned char endc = 0;
+   if (!final)
    {
-      p = (const unsigned char *) "";
-      er = "NULL file";
-   };
+      end = x->data + x->cut;
+      endc = *end;
+      *(unsigned char *) end = 0;
+   }
+   int line = x->line,
+      character = x->character;
+   const char *er = NULL;       // Error
+   int committed = 0;           // Token has changed the tree, so any error is not just the data being incomplete
    unsigned int utf8 (void)
    {                            // return next letter as UTF8
       if (p[0] < 0x80)
@@ -240,25 +848,36 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
          return ((p[0] & 0x7) << 18) + ((p[1] & 0x3F) << 12) + ((p[2] & 0x3F) << 6) + (p[3] & 0x3F);
       return 0xFFFD;            // Bad
    }
-   void write_utf8 (FILE * o, unsigned int c)
+   void addb (size_t l, const unsigned char *s)
+   {
+      parser_addb (x, l, s);
+   }
+   addb (0, NULL);              // Always have a buffer, even if nothing stored
+   void write_utf8 (unsigned int c)
    {
+      unsigned char u[4];
       if (c < 0x80)
-         fputc (c, o);
-      else if (c < 0x800)
       {
-         fputc (0xC0 + (c >> 6), o);
-         fputc (0x80 + (c & 0x3F), o);
+         u[0] = c;
+         addb (1, u);
+      } else if (c < 0x800)
+      {
+         u[0] = 0xC0 + (c >> 6);
+         u[1] = 0x80 + (c & 0x3F);
+         addb (2, u);
       } else if (c < 0x10000)
       {
-         fputc (0xE0 + (c >> 12), o);
-         fputc (0x80 + ((c >> 6) & 0x3F), o);
-         fputc (0x80 + (c & 0x3F), o);
+         u[0] = 0xE0 + (c >> 12);
+         u[1] = 0x80 + ((c >> 6) & 0x3F);
+         u[2] = 0x80 + (c & 0x3F);
+         addb (3, u);
       } else if (c < 0x200000)
       {
-         fputc (0xF0 + (c >> 18), o);
-         fputc (0x80 + ((c >> 12) & 0x3F), o);
-         fputc (0x80 + ((c >> 6) & 0x3F), o);
-         fputc (0x80 + (c & 0x3F), o);
+         u[0] = 0xF0 + (c >> 18);
+         u[1] = 0x80 + ((c >> 12) & 0x3F);
+         u[2] = 0x80 + ((c >> 6) & 0x3F);
+         u[3] = 0x80 + (c & 0x3F);
+         addb (4, u);
       } else
          er = "Bad UTF-8 write";
    }
@@ -280,24 +899,36 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
 #error CPP not coded
 #endif
          }
-         // Move on
+         // Move on, as utf8(), so never past a null
          if (*p < 0x80)
             p++;                // ASCII
-         else if (*p < 0xC0)
-            p++;                // Bad UTF-8
+         else if (*p >= 0xC2 && *p <= 0xDF && (p[1] & 0xC0) == 0x80)
+            p += 2;             // UTF-8 sizes
+         else if (*p >= 0xE0 && *p <= 0xEF && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80)
+            p += 3;             // UTF-8 sizes
+         else if (*p >= 0xF0 && *p <= 0xF7 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80 && (p[3] & 0xC0) == 0x80)
+            p += 4;             // UTF-8 sizes
          else
-         {                      // Normal UTF8
-            if (!utf8 ())
-               p++;             // Bad UTF8, cannot be 0 so cannot be valid
-            else if (*p >= 0xF0)
-               p += 4;          // UTF-8 sizes
-            else if (*p >= 0xE0)
-               p += 3;          // UTF-8 sizes
-            else
-               p += 2;          // UTF-8 sizes
-         }
+            p++;                // Bad UTF-8, one byte at a time
       }
    }
+   const unsigned char *scan (unsigned char a, unsigned char b, unsigned char c)
+   {                            // Move p over plain ASCII up to a, b, c, null, or non ASCII, accounting as next(). Returns start.
+      const unsigned char *s = p,
+         *nl;
+      int lines;
+      p = xml_scan (p, a, b, c, &lines, &nl);
+      if (p > s && !er)
+      {
+         posn = p - 1;
+         line += lines;
+         if (nl)
+            character = p - nl;
+         else
+            character += p - s;
+      }
+      return s;
+   }
    inline int iss (unsigned char c)
    {                            // Is "S" (i.e. whitespace)
       if (c == ' ' || c == 9 || c == 10 || c == 13)
@@ -305,12 +936,12 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
       return 0;
    }
    inline unsigned int isnamestartchar (unsigned int c)
-   {                            // https://www.w3.org/TR/xml/#NT-NameStartChar
+   {                            // https://www.w3.org/TR/xml/#NT-NameStartChar (ASCII is checked using namechar[])
       if (c == ':' || c == '_' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= 0xC0 && c <= 0xD6)
-          || (c >= 0xF8 && c <= 0x2FF) || (c >= 0x370 && c <= 0x37D) || (c >= 0x37F && c <= 0x1FFF) || (c >= 0x200C && c <= 0x200D)
-          || (c >= 0x2070 && c <= 0x218F) || (c >= 0x2C00 && c <= 0x2FEF) || (c >= 0x3001 && c <= 0xD7FF) || (c >= 0xF900
-                                                                                                              && c <= 0xFDCF)
-          || (c >= 0xFDF0 && c <= 0xFFFD) || (c >= 0x10000 && c <= 0xEFFFF))
+          || (c >= 0xD8 && c <= 0xF6) || (c >= 0xF8 && c <= 0x2FF) || (c >= 0x370 && c <= 0x37D) || (c >= 0x37F && c <= 0x1FFF)
+          || (c >= 0x200C && c <= 0x200D) || (c >= 0x2070 && c <= 0x218F) || (c >= 0x2C00 && c <= 0x2FEF) || (c >= 0x3001
+                                                                                                               && c <= 0xD7FF)
+          || (c >= 0xF900 && c <= 0xFDCF) || (c >= 0xFDF0 && c <= 0xFFFD) || (c >= 0x10000 && c <= 0xEFFFF))
          return c;
       return 0;
    }
@@ -321,20 +952,33 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
          return c;
       return 0;
    }
-   inline unsigned int isnames (unsigned int c)
-   {                            // https://www.w3.org/TR/xml/#NT-Names
-      if (isnamechar (c) || c == ' ')
-         return c;
-      return 0;
+   char *borrow (const unsigned char *s, size_t l)
+   {                            // In-situ string, null terminated in place
+      if (!l)
+         return (char *) empty;
+      ((unsigned char *) s)[l] = 0;
+      return (char *) s;
    }
    const unsigned char *parse_name (void)
    {                            // Parse name, NULL if not a valid name
       const unsigned char *start = p;
-      if (!isnamestartchar (utf8 ()))
+      if (!(namechar[*p] & NAME_START) && (!(namechar[*p] & NAME_UTF8) || !isnamestartchar (utf8 ())))
          return NULL;           // Not a name
       next (1);
-      while (isnamechar (utf8 ()))
+      while (1)
+      {                         // Runs of ASCII name characters (never a new line), then any non ASCII one
+         const unsigned char *s = p;
+         while (namechar[*p] & NAME_CHAR)
+            p++;
+         if (p > s && !er)
+         {
+            posn = p - 1;
+            character += p - s;
+         }
+         if (!(namechar[*p] & NAME_UTF8) || !isnamechar (utf8 ()))
+            break;
          next (1);
+      }
       return start;
    }
    int parse_pi (xml_t e)
@@ -355,10 +999,17 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
          next (1);
       const unsigned char *content = p;
       while (*p && (*p != '?' || p[1] != '>'))
-         next (1);
+      {
+         if (*p == '?' || *p >= 0x80)
+            next (1);
+         else
+            scan ('?', '?', '?');
+      }
       if (*p)
       {                         // found end
          xml_pi_add_l (e, namel, (const char *) name, p - content, (const char *) content);
+         if (x->pull && !x->capture)
+            x->event = XML_READER_PI;
          next (2);
          return 1;
       }
@@ -374,7 +1025,12 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
          return 0;
       next (4);
       while (*p && memcmp (p, "-->", 3))
-         next (1);
+      {
+         if (*p == '-' || *p >= 0x80)
+            next (1);
+         else
+            scan ('-', '-', '-');
+      }
       if (*p)
       {
          next (3);
@@ -384,7 +1040,7 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
       er = "Bad comment";
       return 0;
    }
-   int parse_reference (FILE * o)
+   int parse_reference (void)
    {
       if (*p != '&')
          return 0;
@@ -396,15 +1052,15 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
       {
          int l = p - s;
          if (l == 3 && !memcmp (s, "amp", l))
-            fputc ('&', o);
+            write_utf8 ('&');
          else if (l == 2 && !memcmp (s, "lt", l))
-            fputc ('<', o);
+            write_utf8 ('<');
          else if (l == 2 && !memcmp (s, "gt", l))
-            fputc ('>', o);
+            write_utf8 ('>');
          else if (l == 4 && !memcmp (s, "apos", l))
-            fputc ('\'', o);
+            write_utf8 ('\'');
          else if (l == 4 && !memcmp (s, "quot", l))
-            fputc ('"', o);
+            write_utf8 ('"');
          else if (*s == '#')
          {
             unsigned int c = 0;
@@ -416,7 +1072,7 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
                   c = c * 10 + (*s - '0');
             if (s != p)
                er = "Bad character reference";
-            write_utf8 (o, c);
+            write_utf8 (c);
          } else
             er = "Unknown reference";
          next (1);
@@ -425,15 +1081,37 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
       er = "Bad reference";
       return 0;
    }
-   int parse_chardata (FILE * o)
-   {                            // Write character
+   int parse_chardata (void)
+   {                            // Write character, or run of valid non ASCII characters which are simply copied
+      const unsigned char *s = p;
+      int l,
+        n = 0;
+      while ((l = utf8_len (p)) > 1)
+      {
+         if (!er)
+            posn = p;
+         p += l;
+         n++;
+      }
+      if (n)
+      {
+         if (!er)
+            character += n;
+         addb (p - s, s);
+         return 1;
+      }
       unsigned int c = utf8 ();
       if (c)
-         write_utf8 (o, c);
+         write_utf8 (c);
       next (1);
       return 1;
    }
-   int parse_cdsect (FILE * o)
+   void parse_text (unsigned char q)
+   {                            // Copy run of plain ASCII straight to scratch, stops at markup, reference, quote q, or non ASCII
+      const unsigned char *s = scan ('<', '&', q);
+      addb (p - s, s);
+   }
+   int parse_cdsect (void)
    {
       if (er)
          return 0;
@@ -441,7 +1119,15 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
          return 0;
       next (9);
       while (*p && memcmp (p, "]]>", 3) && !er)
-         parse_chardata (o);
+      {
+         if (*p == ']' || *p >= 0x80)
+            parse_chardata ();
+         else
+         {
+            const unsigned char *s = scan (']', ']', ']');
+            addb (p - s, s);
+         }
+      }
       if (*p)
       {
          next (3);
@@ -450,9 +1136,8 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
       er = "Bad CDATA";
       return 0;
    }
-   int parse_xmldecl (xml_t e)
+   int parse_xmldecl (void)
    {
-      e = e;
       if (er)
          return 0;
       if (memcmp (p, "<?xml", 5) || !iss (p[5]))
@@ -469,23 +1154,6 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
       er = "Invalid XML declaration";
       return 0;
    }
-   void parse_misc (xml_t e)
-   {                            // Comment, PI or S
-      while (!er)
-      {
-         if (iss (*p))
-         {                      // S
-            next (1);
-            continue;
-         }
-         if (parse_comment (e))
-            continue;
-         if (parse_pi (e))
-            continue;
-         // No more misc
-         return;
-      }
-   }
    int parse_doctypedecl (xml_t e)
    {
       if (er)
@@ -515,110 +1183,85 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
       if (*p && !er)
       {                         // End
          xml_pi_add_l (e, 8, "!DOCTYPE", p - content, (const char *) content);
+         if (x->pull && !x->capture)
+            x->event = XML_READER_PI;
          next (1);
          return 1;
       }
       er = "Bad doctype";
       return 0;
    }
-   int parse_prolog (xml_t e)
-   {                            // Prolog
-      int r = parse_xmldecl (e);
-      parse_misc (e);
-      if (parse_doctypedecl (e))
-         parse_misc (e);
-      return r;
-   }
-   int parse_element (xml_t e)
-   {
-      if (er)
-         return 0;
-      int parse_attribute (xml_t e, int live)
+   void skip_to (const unsigned char *e)
+   {                            // Move p on to e, accounting as next()
+      const unsigned char *nl = NULL,
+         *q;
+      for (q = p; (q = memchr (q, '\n', e - q)); q++)
       {
-         if (er)
-            return 0;
-         while (iss (*p))
-            next (1);           // S
-         if (*p == '/' || *p == '>')
-            return 0;           // No more attributes
-         const unsigned char *atag = parse_name ();
-         if (!atag)
-         {
-            er = "Bad attribute name";
-            return 0;
-         }
-         int atagl = p - atag;
-         const unsigned char *name = atag;
-         int namel = atagl;
-         {
-            const unsigned char *q;
-            for (q = atag; q < p && *q != ':'; q++);
-            if (q > atag && q < p)
-            {
-               name = q + 1;
-               namel = p - (q + 1);
-            }
-         }
-         while (iss (*p))
-            next (1);
-         if (*p != '=')
-         {
-            er = "Missing attribute = sign";
-            return 0;
-         }
-         next (1);
-         while (iss (*p))
-            next (1);
-         if (*p != '\'' && *p != '"')
-         {
-            er = "Unquoted/missing attribute value";
-            return 0;
-         }
-         unsigned char q = *p;
-         next (1);
-         char *content = NULL;
-         size_t contentl = 0;
-         FILE *o = open_memstream (&content, &contentl);
-         while (*p && *p != q && *p != '<')
-         {
-            if (*p == '&')
-               parse_reference (o);
-            else
-               parse_chardata (o);
-         }
-         fclose (o);
-         if (*p == q)
-         {
-            next (1);
-            xml_namespace_t ns = NULL;
-            if (name == atag && namel == 5 && !memcmp (name, "xmlns", 5))
-            {
-               ns_stack (0, NULL, contentl, content);   // Default namespace
-               name = NULL;
-            } else if (name != atag)
-            {                   // prefix
-               if (name - atag == 6 && !memcmp (atag, "xmlns", 5))
-               {
-                  if (!live)
-                     ns_stack (namel, name, contentl, content); // Define namespace
-                  name = NULL;
-               } else if (live && !(ns = ns_find (name - atag - 1, atag)))
-                  er = "Unknown namespace";
-            }
-            if (name && live)
-               xml_attribute_set_ns_l (e, ns, namel, (const char *) name, contentl, (const char *) content);
-            free (content);
-            return 1;
-         }
-         if (content)
-            free (content);
-         er = "Unclosed quote";
+         line++;
+         nl = q;
+      }
+      if (nl)
+         character = 0;
+      else
+         nl = p - 1;
+      for (q = nl + 1; q < e; q++)
+         if ((*q & 0xC0) != 0x80)
+            character++;        // Not a UTF-8 continuation
+      if (nl >= p)
+         character++;
+      if (e > p)
+         posn = e - 1;
+      p = e;
+   }
+   int parse_skip (void)
+   {                            // Projection, skip content up to and including the ETag that closes it, without building or checking anything
+      const unsigned char *q = p;
+      int depth = 1;
+      while (depth && q && (q = (const unsigned char *) strchr ((const char *) q, '<')))
+         if ((q = xml_skip_markup (q, &depth)))
+            q++;
+      if (!q)
+      {
+         skip_to (p + strlen ((const char *) p));
+         er = "Unclosed element";
          return 0;
       }
+      skip_to (q);
+      return 1;
+   }
+   int select_step (struct xml_step_s *s, int namel, const unsigned char *name, xml_namespace_t ns)
+   {                            // Projection, does step match, name space is only checked if name is NULL
+      if (name)
+         return (s->namel == 1 && *s->name == '*') || (s->namel == namel && !memcmp (s->name, name, namel));
+      if (!s->prefix)
+         return 1;
+      if (!ns)
+         return 0;
+      xml_namespacelist_t l = namespace_find (x->root->tree, strlen (ns->uri), ns->uri);
+      return l->tag && !strcmp_l (strlen (l->tag), l->tag, s->prefixl, s->prefix);
+   }
+   void parse_end (void)
+   {                            // End of root element
+      if (!x->callback)
+      {
+         x->state = XML_PARSE_EPILOG;
+         return;
+      }
+      x->callback (x->root);
+      xml_tree_delete (x->root);
+      parser_reset (x);
+   }
+   int parse_stag (void)
+   {                            // Start tag, or empty element tag, creating the element
       if (er)
          return 0;
       if (*p != '<' || p[1] == '/' || p[1] == '!' || p[1] == '-' || p[1] == '?')
          return 0;              // not an element
+      if (xml_depth_max && x->depth >= xml_depth_max)
+      {
+         er = "Elements nested too deep";
+         return 0;
+      }
       next (1);
       const unsigned char *stag = parse_name ();
       if (!stag)
@@ -639,21 +1282,191 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
             namel = p - (q + 1);
          }
       }
-      xml_t n = e;
-      if (e == root && !root->name)
-         root->name = xml_dup_l (namel, (const char *) name);
-      else
-         n = xml_element_add_ns_after_l (e, NULL, namel, (const char *) name, NULL);
-      if (!n)
+      unsigned long long sel = 0;       // Projection, paths this element may be on
+      int select = x->select && !(x->depth && x->stack[x->depth - 1].whole);
+      if (select)
       {
-         er = "Something wrong";
-         return 0;
+         unsigned long long m = x->depth ? x->stack[x->depth - 1].select : x->select->all;
+         int i;
+         for (i = 0; i < x->select->n; i++)
+            if ((m & (1ULL << i)) && x->select->path[i].steps > x->depth
+                && select_step (x->select->path[i].step + x->depth, namel, name, NULL))
+               sel |= (1ULL << i);
+         if (!sel && x->depth)
+         {                      // Not wanted, skip the whole element
+            int depth = 0;
+            const unsigned char *e = xml_skip_markup (stag - 1, &depth);
+            if (!e)
+            {
+               er = "Unclosed STag";
+               return 0;
+            }
+            skip_to (e + 1);
+            return !depth || parse_skip ();
+         }
       }
-      {                         // 1 is get name spaces, 2 is process.
-         const unsigned char *back = p;
-         while (parse_attribute (n, 0));        // This gets all the name spaces that apply
-         p = back;
-         while (parse_attribute (n, 1));        // This actually gets the attributes
+      xml_t n = NULL;
+      int nssp = x->nssp;       // Name space stack to go back to at end of element
+      {                         // Attributes, scanned once, then the element is made, name spaces they declare are stacked, then they are added
+         struct
+         {
+            const unsigned char *atag;  // Name including any prefix
+            const unsigned char *value; // Raw value
+            size_t rawl;        // Raw value length
+            size_t decoded;     // Offset of decoded value in scratch
+            size_t valuel;
+            int atagl;
+            int prefixl;        // Length of prefix, 0 if none
+            unsigned char decode:1;     // Value decoded in to scratch
+            const unsigned char *posn;  // Where we were at end, for namespace error
+            int line,
+              character;
+         } attrs[16],
+          *a = attrs;
+         int na = 0,
+            ma = sizeof (attrs) / sizeof (*attrs);
+         size_t base = x->bufl;
+         while (!er)
+         {
+            while (iss (*p))
+               next (1);        // S
+            if (*p == '/' || *p == '>')
+               break;           // No more attributes
+            const unsigned char *atag = parse_name ();
+            if (!atag)
+            {
+               er = "Bad attribute name";
+               break;
+            }
+            int atagl = p - atag;
+            while (iss (*p))
+               next (1);
+            if (*p != '=')
+            {
+               er = "Missing attribute = sign";
+               break;
+            }
+            next (1);
+            while (iss (*p))
+               next (1);
+            if (*p != '\'' && *p != '"')
+            {
+               er = "Unquoted/missing attribute value";
+               break;
+            }
+            unsigned char q = *p;
+            next (1);
+            if (na == ma)
+            {                   // More space
+               ma *= 2;
+               if (a == attrs)
+               {
+                  a = malloc (sizeof (*a) * ma);
+                  if (a)
+                     memcpy (a, attrs, sizeof (attrs));
+               } else
+                  a = realloc (a, sizeof (*a) * ma);
+               if (!a)
+                  errx (1, "malloc at line %d", __LINE__);
+            }
+            a[na].atag = atag;
+            a[na].atagl = atagl;
+            a[na].prefixl = 0;
+            for (const unsigned char *c = atag; c < atag + atagl; c++)
+               if (*c == ':')
+               {
+                  if (c > atag && c + 1 < atag + atagl)
+                     a[na].prefixl = c - atag;
+                  break;
+               }
+            a[na].decode = 0;
+            a[na].decoded = x->bufl;
+            const unsigned char *v = p;
+            while (*p && *p != q && *p != '<')
+            {
+               if (*p == '&' || *p >= 0x80)
+               {                // Needs decoding, so copy what we have so far and decode from here on
+                  if (!a[na].decode)
+                     addb (p - v, v);
+                  a[na].decode = 1;
+                  if (*p == '&')
+                     parse_reference ();
+                  else
+                     parse_chardata ();
+               } else if (a[na].decode)
+                  parse_text (q);
+               else
+                  scan (q, '<', '&');
+            }
+            if (*p != q)
+            {
+               er = "Unclosed quote";
+               break;
+            }
+            a[na].value = v;
+            a[na].rawl = p - v;
+            if (a[na].decode)
+               a[na].valuel = x->bufl - a[na].decoded;
+            else
+               a[na].valuel = p - v;
+            next (1);
+            a[na].posn = posn;
+            a[na].line = line;
+            a[na].character = character;
+            na++;
+         }
+         if (!er)
+         {                      // Whole tag, make the element
+            committed = 1;
+            if (x->depth)
+               n = xml_element_add_ns_after_l (x->stack[x->depth - 1].n, NULL, namel, (const char *) name, NULL);
+            else
+               (n = x->root)->name = name_intern (x->root->tree, namel, (const char *) name);
+            if (!n)
+               er = "Something wrong";
+         }
+         // Values, as decoded values are in scratch which may have moved
+         const char *value (int i)
+         {
+            if (a[i].decode)
+               return x->buf + a[i].decoded;
+            return (const char *) a[i].value;
+         }
+         int i;
+         for (i = 0; i < na && !er; i++)
+         {                      // Name spaces
+            if (!a[i].prefixl && a[i].atagl == 5 && !memcmp (a[i].atag, "xmlns", 5))
+               parser_ns (x, 0, NULL, a[i].valuel, value (i));  // Default namespace
+            else if (a[i].prefixl == 5 && !memcmp (a[i].atag, "xmlns", 5))
+               parser_ns (x, a[i].atagl - 6, a[i].atag + 6, a[i].valuel, value (i));    // Define namespace
+         }
+         for (i = 0; i < na && !er; i++)
+         {                      // Attributes
+            if (a[i].prefixl ? a[i].prefixl == 5 && !memcmp (a[i].atag, "xmlns", 5) : a[i].atagl == 5
+                && !memcmp (a[i].atag, "xmlns", 5))
+               continue;        // Namespace declaration
+            xml_namespace_t ns = NULL;
+            if (a[i].prefixl && !(ns = parser_ns_find (x, a[i].prefixl, a[i].atag)))
+            {
+               er = "Unknown namespace";
+               posn = a[i].posn;
+               line = a[i].line;
+               character = a[i].character;
+               break;
+            }
+            int skip = a[i].prefixl ? a[i].prefixl + 1 : 0;
+            if (x->insitu && a[i].valuel <= a[i].rawl)
+            {                   // Name and value left in place
+               if (a[i].decode)
+                  memcpy ((unsigned char *) a[i].value, x->buf + a[i].decoded, a[i].valuel);
+               attribute_set (n, ns, a[i].atagl - skip, (const char *) a[i].atag + skip, a[i].valuel, borrow (a[i].value, a[i].valuel),
+                              1);
+            } else
+               xml_attribute_set_ns_l (n, ns, a[i].atagl - skip, (const char *) a[i].atag + skip, a[i].valuel, value (i));
+         }
+         x->bufl = base;
+         if (a != attrs)
+            free (a);
       }
       if (er)
          return 0;
@@ -661,13 +1474,72 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
       int nsl = 0;
       if (name > stag)
          nsl = name - stag - 1;
-      xml_namespace_t ns = ns_find (nsl, stag);
+      xml_namespace_t ns = parser_ns_find (x, nsl, stag);
       if (!ns && nsl)
+      {
          er = "Unknown element namespace";
+         return 0;
+      }
       n->namespace = ns;
-      if (*p == '/' && p[1] == '>')
-      {                         // EmptyElemTag
-         next (2);
+      unsigned long long part = 0;      // Projection, paths this element is part way along
+      int whole = !select,
+         skip = 0;
+      if (select)
+      {
+         unsigned long long attrs = 0;  // Paths for attributes of this element
+         int i;
+         for (i = 0; i < x->select->n; i++)
+            if ((sel & (1ULL << i)) && select_step (x->select->path[i].step + x->depth, 0, NULL, ns))
+            {
+               if (x->select->path[i].steps > x->depth + 1)
+                  part |= (1ULL << i);
+               else if (x->select->path[i].attribute.name)
+                  attrs |= (1ULL << i);
+               else
+                  whole = 1;
+            }
+         if (!whole)
+         {                      // Only the attributes asked for, and no content unless there are paths within
+            xml_attribute_t a = n->first_attribute;
+            while (a)
+            {
+               xml_attribute_t next = a->next;
+               for (i = 0; i < x->select->n; i++)
+                  if ((attrs & (1ULL << i))
+                      && select_step (&x->select->path[i].attribute, strlen (a->name), (unsigned char *) a->name, NULL)
+                      && select_step (&x->select->path[i].attribute, 0, NULL, a->namespace))
+                     break;
+               if (i == x->select->n)
+                  xml_attribute_delete (a);
+               a = next;
+            }
+            if (!part)
+            {
+               skip = 1;
+               if (!attrs && x->depth)
+                  n = xml_element_delete (n);   // Not wanted after all
+            }
+         }
+      }
+      if ((*p == '/' && p[1] == '>') || (skip && *p == '>'))
+      {                         // EmptyElemTag, or projection not wanting content
+         if (*p == '/')
+            next (2);
+         else
+         {
+            next (1);
+            if (!parse_skip ())
+               return 0;
+         }
+         parser_ns_pop (x, nssp);
+         if (x->pull && !x->capture)
+         {
+            x->event = XML_READER_START;
+            x->current = n;
+            x->empty = 1;
+         }
+         if (!x->depth)
+            parse_end ();
          return 1;
       }
       // STag
@@ -677,39 +1549,37 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
          return 0;
       }
       next (1);
-      char *content = NULL;
-      size_t contentl = 0;
-      FILE *o = open_memstream (&content, &contentl);
-      while (*p && (*p != '<' || p[1] != '/') && !er)
-      {                         // content
-         while (*p && *p != '<' && *p != '&')
-            parse_chardata (o);
-         if (parse_reference (o))
-            continue;
-         if (parse_cdsect (o))
-            continue;
-         if (parse_pi (n))
-            continue;           // At some point we may want to break the content around the pi
-         if (parse_comment (n))
-            continue;           // At some point we may want to break the content around the elements
-         int nsssave = nssp;    // Retain NS stack position
-         parse_element (n);
-         nssp = nsssave;
-      }
-      fclose (o);
-      if (content)
+      if (x->depth == x->stacka)
       {
-         xml_element_set_content_l (n, contentl, content);
-         free (content);
+         x->stacka = x->stacka * 2 + 16;
+         x->stack = realloc (x->stack, sizeof (*x->stack) * x->stacka);
+         if (!x->stack)
+            errx (1, "malloc at line %d", __LINE__);
       }
-      if (er)
-         return 0;
-      // Check ETag
-      if (*p != '<' || p[1] != '/')
+      struct xml_frame_s *f = x->stack + x->depth++;
+      f->n = n;
+      f->tag = x->bufl;         // Content is on top of scratch, after tag, above that of parent elements
+      f->tagl = stagl;
+      addb (stagl, stag);
+      f->base = x->bufl;
+      f->nssp = nssp;
+      f->cstart = p;
+      f->decoded = 0;
+      f->kids = 0;
+      f->select = part;
+      f->whole = whole;
+      if (x->pull && !x->capture)
       {
-         er = "Unclosed element";
-         return 0;
+         x->event = XML_READER_START;
+         x->current = n;
       }
+      x->state = XML_PARSE_CONTENT;
+      return 1;
+   }
+   int parse_etag (void)
+   {                            // End tag, setting content
+      struct xml_frame_s *f = x->stack + x->depth - 1;
+      const unsigned char *cend = p;
       next (2);
       const unsigned char *etag = parse_name ();
       if (!etag)
@@ -726,41 +1596,1020 @@ xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail
          return 0;
       }
       next (1);
-      if (etagl != stagl || memcmp (etag, stag, stagl))
+      committed = 1;
+      if (etagl != f->tagl || memcmp (etag, x->buf + f->tag, etagl))
       {
          er = "Mismatched STag/Etag";
          return 0;
       }
+      xml_t n = f->n;
+      size_t contentl = x->bufl - f->base;
+      if (x->pull && (!x->capture || x->capture == x->depth))
+      {                         // Pull reader, end of element or of subtree being built
+         if (x->capture)
+         {
+            xml_element_set_content_l (n, contentl, x->buf + f->base);
+            x->capture = 0;
+         }
+         x->event = XML_READER_END;
+         x->current = n;
+      } else if (x->select && !f->whole)
+      {                         // Projection, content not wanted
+      } else if (x->insitu && !f->kids && contentl <= (size_t) (cend - f->cstart))
+      {                         // Content left in place, nothing else in the way
+         if (f->decoded)
+            memcpy ((unsigned char *) f->cstart, x->buf + f->base, contentl);
+         n->content = borrow (f->cstart, contentl);
+      } else
+         xml_element_set_content_l (n, contentl, x->buf + f->base);
+      x->bufl = f->tag;
+      parser_ns_pop (x, f->nssp);
+      if (!--x->depth)
+         parse_end ();
       return 1;
    }
-   parse_prolog (root);
-   if (!parse_element (root) && !er)
-      er = "No root element";
-   parse_misc (root);
-   if (!er && *p)
-      er = "Extra data after xml";
+   int parse_token (void)
+   {                            // Parse next token, 0 if error or no more data for now
+      if (x->state == XML_PARSE_CONTENT)
+      {                         // content
+         if (x->stop && p >= x->data + x->stop)
+            return 0;           // End of part
+         struct xml_frame_s *f = x->stack + x->depth - 1;
+         if (*p == '<')
+         {
+            if (x->pull && !x->capture && p[1] != '!' && x->bufl > f->base)
+            {                   // Pull reader, text so far before the tag or PI
+               x->event = XML_READER_TEXT;
+               x->current = f->n;
+               return 1;
+            }
+            if (p[1] == '/')
+               return parse_etag ();
+            if (parse_cdsect () || parse_pi (f->n) || parse_comment (f->n))
+            {                   // At some point we may want to break the content around the pi, etc
+               f->decoded = 1;
+               return 1;
+            }
+            f->kids = 1;
+            if (parse_stag ())
+               return 1;
+            if (!er)
+               er = "Bad markup";
+            return 0;
+         }
+         if (*p == '&')
+         {
+            f->decoded = 1;
+            return parse_reference ();
+         }
+         if (!*p)
+         {
+            if (!end || p < end)
+               er = "Unclosed element";
+            return 0;
+         }
+         while (*p && *p != '<' && *p != '&')
+         {
+            if (*p >= 0x80)
+            {
+               f->decoded = 1;
+               parse_chardata ();
+            } else
+               parse_text (0);
+         }
+         return 1;
+      }
+      if (x->state == XML_PARSE_START)
+      {
+         if (parse_xmldecl ())
+         {
+            x->state = XML_PARSE_PROLOG;
+            return 1;
+         }
+         if (er)
+            return 0;
+         x->state = XML_PARSE_PROLOG;
+      }
+      // Misc: Comment, PI or S
+      if (iss (*p))
+      {
+         while (iss (*p))
+            next (1);
+         return 1;
+      }
+      if (parse_comment (x->root) || parse_pi (x->root))
+         return 1;
+      if (er)
+         return 0;
+      if (!*p && (!end || p >= end))
+      {                         // End of data
+         if (!end && x->state == XML_PARSE_PROLOG && !x->callback)
+            er = "No root element";
+         return 0;
+      }
+      if (x->state == XML_PARSE_EPILOG)
+      {
+         er = "Extra data after xml";
+         return 0;
+      }
+      if (!x->doctype && parse_doctypedecl (x->root))
+      {
+         x->doctype = 1;
+         return 1;
+      }
+      if (parse_stag ())
+         return 1;
+      if (!er)
+         er = "No root element";
+      return 0;
+   }
+   x->event = 0;
+   while (!er && !x->event)
+   {
+      const unsigned char *tp = p,
+         *tposn = posn;
+      int tline = line,
+         tcharacter = character;
+      size_t tbufl = x->bufl;
+      committed = 0;
+      if (parse_token ())
+         continue;
+      if (er && end && p >= end && !committed)
+      {                         // Incomplete, try again when we have more data
+         er = NULL;
+         p = tp;
+         posn = tposn;
+         line = tline;
+         character = tcharacter;
+         x->bufl = tbufl;
+      }
+      break;
+   }
+   if (end)
+      *(unsigned char *) end = endc;
+   x->used = p - x->data;
+   x->posn = posn - x->data;
+   x->line = line;
+   x->character = character;
    if (er)
    {                            // Error
-      xml_tree_delete (root);
-      root = NULL;
+      if (x->fail)
+         x->fail (x->filename, line, character, er, posn);
+      xml_tree_delete (x->root);        // Also frees in-situ buffer
+      x->root = NULL;
+      x->state = XML_PARSE_ERROR;
+   }
+}
+
+static xml_t
+xml_parse (const char *filename, const unsigned char *xml, xml_error_func * fail, int insitu, struct xml_select_s *select)
+{                               // Parse null terminated XML data
+   // If insitu, xml is malloced, writable and becomes owned by the tree: names and content are null terminated and left in place
+   // If select, only elements on the selected paths are parsed
+   if (!xml)
+   {
       if (fail)
-         fail (filename, line, character, er, posn);
+         fail (filename, 0, 0, "NULL file", NULL);
+      return NULL;
+   }
+   struct xml_parser_s x;
+   parser_init (&x, filename, fail, NULL);
+   x.select = select;
+   x.data = (unsigned char *) xml;
+   if (insitu)
+   {
+      x.insitu = 1;
+      x.root->tree->buffer = (char *) xml;
+      x.root->tree->bufferlen = strlen ((char *) xml) + 1;
+   }
+   parser_run (&x, 1);
+   return parser_end (&x);
+}
+
+static struct xml_select_s *
+select_new (const char **paths)
+{                               // Projection paths, xml_get style, pointing in to the path strings
+   struct xml_select_s *s = xml_alloc (sizeof (*s));
+   while (paths[s->n])
+      s->n++;
+   if (s->n > 64)
+      errx (1, "Too many select paths");
+   s->all = (s->n == 64 ? ~0ULL : (1ULL << s->n) - 1);
+   s->path = xml_alloc (sizeof (*s->path) * s->n);
+   int i;
+   for (i = 0; i < s->n; i++)
+   {
+      struct xml_path_s *path = s->path + i;
+      const char *full = paths[i],
+         *p = full;
+      int n = 2;
+      while (*p)
+         if (*p++ == '/')
+            n++;
+      path->step = xml_alloc (sizeof (*path->step) * n);
+      p = full;
+      if (*p != '/')
+      {                         // Relative to root, so any root
+         path->step[0].name = "*";
+         path->step[0].namel = 1;
+         path->steps++;
+      }
+      while (*p)
+      {
+         while (*p == '/')
+            p++;
+         if (!*p)
+            break;
+         struct xml_step_s *step = path->step + path->steps;
+         if (*p == '@')
+         {
+            step = &path->attribute;
+            p++;
+         }
+         const char *name = p;
+         while (*p && *p != ':' && *p != '/' && *p != '@')
+            p++;
+         if (*p == ':')
+         {
+            step->prefix = name;
+            step->prefixl = p - name;
+            name = ++p;
+            while (*p && *p != ':' && *p != '/' && *p != '@')
+               p++;
+            if (*p == ':')
+               errx (1, "Bad path, two namespace prefixes in [%s]", full);
+         }
+         if (p == name)
+            errx (1, "Empty name in path [%s]", full);
+         if (p - name == 2 && !strncmp (name, "..", 2))
+            errx (1, "Cannot use .. in select path [%s]", full);
+         step->name = name;
+         step->namel = p - name;
+         if (step == &path->attribute)
+         {
+            if (*p)
+               errx (1, "Attribute has to be last in path in [%s]", full);
+         } else
+            path->steps++;
+      }
    }
-   if (nss)
-      free (nss);
-   return root;                 // OK - no error
+   return s;
+}
+
+static void
+select_free (struct xml_select_s *s)
+{
+   int i;
+   for (i = 0; i < s->n; i++)
+      free (s->path[i].step);
+   free (s->path);
+   free (s);
 }
 #endif
 
+struct xml_map_s
+{                               // Values by pointer, open addressing, for what only a few elements need so is kept out of struct xml_s
+   int size,                    // Power of 2
+    used;                       // Slots used
+   struct
+   {
+      const void *key;          // NULL if slot not used
+      void *value;
+   } slot[];
+};
+
+static unsigned int
+map_hash (const void *p)
+{                               // Hash of a pointer, by address
+   return ((size_t) p >> 3) * 2654435761U;
+}
+
+static int
+map_slot (xml_map_t m, const void *key)
+{                               // Slot for key, or the empty slot where it would go
+   unsigned int i = map_hash (key);
+   while (m->slot[i & (m->size - 1)].key && m->slot[i & (m->size - 1)].key != key)
+      i++;
+   return i & (m->size - 1);
+}
+
+static void *
+map_get (xml_map_t m, const void *key)
+{                               // Value for key, NULL if none
+   if (!m)
+      return NULL;
+   return m->slot[map_slot (m, key)].value;
+}
+
+static void
+map_set (xml_root_t t, xml_map_t * mp, const void *key, void *value)
+{                               // Set value for key, NULL to remove, the map being allocated in tree t
+   xml_map_t m = *mp;
+   if (!m)
+   {
+      if (!value)
+         return;
+      m = *mp = xml_alloc_t (t, sizeof (*m) + 16 * sizeof (*m->slot));
+      m->size = 16;
+   }
+   int i = map_slot (m, key);
+   if (value)
+   {
+      if (!m->slot[i].key)
+      {
+         if ((m->used + 1) * 2 > m->size)
+         {                      // Grow
+            xml_map_t n = xml_alloc_t (t, sizeof (*n) + m->size * 2 * sizeof (*n->slot));
+            n->size = m->size * 2;
+            n->used = m->used;
+            int j;
+            for (j = 0; j < m->size; j++)
+               if (m->slot[j].key)
+                  n->slot[map_slot (n, m->slot[j].key)] = m->slot[j];
+            xml_free_s (t, m);
+            *mp = m = n;
+            i = map_slot (m, key);
+         }
+         m->slot[i].key = key;
+         m->used++;
+      }
+      m->slot[i].value = value;
+      return;
+   }
+   if (!m->slot[i].key)
+      return;
+   m->used--;
+   int j = i;
+   while (1)
+   {                            // Remove, moving back later entries in the run that cannot be found past the gap
+      m->slot[i].key = NULL;
+      m->slot[i].value = NULL;
+      while (1)
+      {
+         j = (j + 1) & (m->size - 1);
+         if (!m->slot[j].key)
+            return;
+         int h = map_hash (m->slot[j].key) & (m->size - 1);
+         if (i < j ? (h <= i || h > j) : (h <= i && h > j))
+            break;              // Home slot is not between the gap and here
+      }
+      m->slot[i] = m->slot[j];
+      i = j;
+   }
+}
+
+#define	XML_CHILDREN_SCAN	32      // Children skipped in a scan before the parent's children are indexed
+
+struct xml_child_name_s
+{
+   xml_name_t name;             // NULL if slot not used
+   xml_t first,                 // First child with this name, NULL if none now
+    last;                       // Last child with this name
+   int count;                   // Children with this name
+};
+
+typedef struct xml_children_s *xml_children_t;
+struct xml_children_s
+{                               // Children of an element by name, open addressing on the interned name, and by position
+   int size,                    // Power of 2
+    used;                       // Slots with a name
+   int count;                   // Children
+   int atn;                     // Allocated size of at
+   xml_t *at;                   // Children in order when needed, kept when adding at the end, else dropped when children change
+   xml_map_t next;              // Next child with the same name, by child, none for the last
+   struct xml_child_name_s slot[];
+};
+
+static unsigned int
+name_hash (xml_name_t n)
+{                               // Hash of an interned name, by address
+   return ((size_t) n >> 3) * 2654435761U;
+}
+
+static struct xml_child_name_s *
+children_slot (xml_children_t x, xml_name_t n)
+{                               // Slot for name, or the empty slot where it would go
+   unsigned int i = name_hash (n);
+   while (x->slot[i & (x->size - 1)].name && x->slot[i & (x->size - 1)].name != n)
+      i++;
+   return &x->slot[i & (x->size - 1)];
+}
+
+static xml_children_t
+children_new (xml_root_t t, int size)
+{
+   xml_children_t x = xml_alloc_t (t, sizeof (*x) + size * sizeof (*x->slot));
+   x->size = size;
+   return x;
+}
+
+static xml_children_t
+children_get (xml_t e)
+{                               // Children index of e, if any
+   return e->indexed ? map_get (e->tree->children, e) : NULL;
+}
+
+static void
+children_set (xml_t e, xml_children_t x)
+{
+   map_set (e->tree, &e->tree->children, e, x);
+   e->indexed = 1;
+}
+
+static void
+children_drop (xml_root_t t, xml_t e)
+{                               // Free children index of e, if any, t being the tree it is in
+   if (!e->indexed)
+      return;
+   xml_children_t x = map_get (t->children, e);
+   map_set (t, &t->children, e, NULL);
+   e->indexed = 0;
+   if (x->at)
+      xml_free_s (t, x->at);
+   if (x->next)
+      xml_free_s (t, x->next);
+   xml_free_s (t, x);
+}
+
+static xml_t
+children_next (xml_children_t x, xml_t e)
+{                               // Next child with the same name
+   return map_get (x->next, e);
+}
+
+static void
+children_add (xml_t parent, xml_t e, int append)
+{                               // Add child to the parent's index, after the previous child with the same name
+   xml_children_t x = children_get (parent);
+   x->count++;
+   if (x->at)
+   {
+      if (e->next)
+         x->at = xml_free_s (parent->tree, x->at);
+      else
+      {                         // At end
+         if (x->count > x->atn)
+         {
+            xml_t *at = xml_alloc_t (parent->tree, sizeof (*at) * x->atn * 2);
+            memcpy (at, x->at, sizeof (*at) * x->atn);
+            xml_free_s (parent->tree, x->at);
+            x->at = at;
+            x->atn *= 2;
+         }
+         x->at[x->count - 1] = e;
+      }
+   }
+   if (!e->name)
+      return;                   // Only a moved root, never found by name
+   struct xml_child_name_s *s = children_slot (x, e->name);
+   if (!s->name)
+   {
+      if ((x->used + 1) * 2 > x->size)
+      {                         // Grow, dropping names with no children
+         xml_children_t n = children_new (parent->tree, x->size * 2);
+         n->count = x->count;
+         n->at = x->at;
+         n->atn = x->atn;
+         n->next = x->next;
+         int i;
+         for (i = 0; i < x->size; i++)
+            if (x->slot[i].first)
+            {
+               *children_slot (n, x->slot[i].name) = x->slot[i];
+               n->used++;
+            }
+         xml_free_s (parent->tree, x);
+         children_set (parent, x = n);
+         s = children_slot (x, e->name);
+      }
+      s->name = e->name;
+      x->used++;
+   }
+   xml_t p = NULL;
+   if (append || !e->next)
+      p = s->last;
+   else if (s->first)
+      for (p = e->prev; p && p->name != e->name; p = p->prev);
+   xml_t next;
+   if (p)
+   {
+      next = children_next (x, p);
+      map_set (parent->tree, &x->next, p, e);
+   } else
+   {
+      next = s->first;
+      s->first = e;
+   }
+   map_set (parent->tree, &x->next, e, next);
+   if (!next)
+      s->last = e;
+   s->count++;
+}
+
+static void
+children_remove (xml_t parent, xml_t e)
+{                               // Remove child from the parent's index, before it is unlinked from its siblings
+   xml_children_t x = children_get (parent);
+   x->count--;
+   if (x->at && e->next)
+      x->at = xml_free_s (parent->tree, x->at);
+   if (!e->name)
+      return;
+   struct xml_child_name_s *s = children_slot (x, e->name);
+   if (s->first == e)
+   {
+      if (!(s->first = children_next (x, e)))
+         s->last = NULL;
+   } else
+   {
+      xml_t p;
+      for (p = e->prev; p && p->name != e->name; p = p->prev);
+      if (!p)
+         return;                // Not indexed
+      map_set (parent->tree, &x->next, p, children_next (x, e));
+      if (s->last == e)
+         s->last = p;
+   }
+   map_set (parent->tree, &x->next, e, NULL);
+   s->count--;
+}
+
+static void
+children_build (xml_t parent)
+{                               // Index the children of parent by name
+   children_set (parent, children_new (parent->tree, 16));
+   xml_t c;
+   for (c = parent->first_child; c; c = c->next)
+      children_add (parent, c, 1);
+}
+
+int
+xml_element_child_count (xml_t e)
+{                               // Count of children, kept in the index if there are many
+   if (!e)
+      return 0;
+   if (!e->indexed)
+   {
+      int n = 0;
+      xml_t c;
+      for (c = e->first_child; c && n < XML_CHILDREN_SCAN; c = c->next)
+         n++;
+      if (!c)
+         return n;
+      children_build (e);
+   }
+   return children_get (e)->count;
+}
+
+int
+xml_element_child_count_by_name_ns (xml_t e, xml_namespace_t namespace, const char *name)
+{                               // Count of children with name (NULL for any) and name space (NULL for any)
+   if (!e)
+      return 0;
+   xml_name_t n = NULL;
+   if (name && !(n = name_find (e->tree, strlen (name), name)))
+      return 0;
+   if (!namespace && !n)
+      return xml_element_child_count (e);
+   if (n && xml_element_child_count (e) > XML_CHILDREN_SCAN)
+   {                            // Indexed
+      xml_children_t x = children_get (e);
+      struct xml_child_name_s *s = children_slot (x, n);
+      if (!namespace)
+         return s->count;
+      int count = 0;
+      xml_t c;
+      for (c = s->first; c; c = children_next (x, c))
+         if (c->namespace == namespace)
+            count++;
+      return count;
+   }
+   int count = 0;
+   xml_t c;
+   for (c = e->first_child; c; c = c->next)
+      if ((!namespace || c->namespace == namespace) && (!n || c->name == n))
+         count++;
+   return count;
+}
+
 xml_t
-xml_element_by_name_ns (xml_t e, xml_namespace_t namespace, const char *name)
+xml_element_child_at (xml_t e, int n)
+{                               // Child n, from 0, or NULL if not that many
+   if (!e || n < 0)
+      return NULL;
+   xml_t c;
+   xml_children_t x = children_get (e);
+   if (n < XML_CHILDREN_SCAN && !(x && x->at))
+   {
+      for (c = e->first_child; c && n--; c = c->next);
+      return c;
+   }
+   if (n >= xml_element_child_count (e))
+      return NULL;
+   x = children_get (e);
+   if (!x->at)
+   {                            // Build
+      x->atn = 16;
+      while (x->atn < x->count)
+         x->atn *= 2;
+      x->at = xml_alloc_t (e->tree, sizeof (*x->at) * x->atn);
+      int i = 0;
+      for (c = e->first_child; c; c = c->next)
+         x->at[i++] = c;
+   }
+   return x->at[n];
+}
+
+#define	XML_ATTRIBUTE_SCAN	32      // Attributes skipped in a scan before the element's attributes are hashed
+
+typedef struct xml_attributes_s *xml_attributes_t;
+struct xml_attributes_s
+{                               // Attributes of an element by name, open addressing on the interned name, the list keeps the order
+   int size,                    // Power of 2
+    used;                       // Slots used, including deleted
+   xml_attribute_t slot[];
+};
+
+static struct xml_attribute_s attribute_deleted;        // Slot of a deleted attribute
+
+static xml_attributes_t
+attributes_get (xml_t e)
+{                               // Attribute hash of e, if any
+   return e->hashed ? map_get (e->tree->attributes, e) : NULL;
+}
+
+static void
+attributes_drop (xml_root_t t, xml_t e)
+{                               // Free attribute hash of e, if any, t being the tree it is in
+   if (!e->hashed)
+      return;
+   xml_free_s (t, map_get (t->attributes, e));
+   map_set (t, &t->attributes, e, NULL);
+   e->hashed = 0;
+}
+
+static void
+attributes_add (xml_attributes_t x, xml_attribute_t a)
+{                               // Add to hash, there is room
+   unsigned int i = name_hash (a->name);
+   while (x->slot[i & (x->size - 1)] && x->slot[i & (x->size - 1)] != &attribute_deleted)
+      i++;
+   if (!x->slot[i & (x->size - 1)])
+      x->used++;
+   x->slot[i & (x->size - 1)] = a;
+}
+
+static void
+attributes_build (xml_t e)
+{                               // Hash the attributes of e, replacing any existing hash
+   int n = 0;
+   xml_attribute_t a;
+   for (a = e->first_attribute; a; a = a->next)
+      n++;
+   int size = 16;
+   while (size <= n * 2)
+      size *= 2;
+   attributes_drop (e->tree, e);
+   xml_attributes_t x = xml_alloc_t (e->tree, sizeof (*x) + size * sizeof (*x->slot));
+   x->size = size;
+   for (a = e->first_attribute; a; a = a->next)
+      attributes_add (x, a);
+   map_set (e->tree, &e->tree->attributes, e, x);
+   e->hashed = 1;
+}
+
+static void
+attributes_remove (xml_attributes_t x, xml_attribute_t a)
+{
+   unsigned int i = name_hash (a->name);
+   while (x->slot[i & (x->size - 1)] && x->slot[i & (x->size - 1)] != a)
+      i++;
+   if (x->slot[i & (x->size - 1)])
+      x->slot[i & (x->size - 1)] = &attribute_deleted;
+}
+
+static xml_attribute_t
+attribute_find (xml_t e, xml_namespace_t namespace, xml_name_t n)
+{                               // Find attribute by interned name, hashing the attributes if that took a long scan
+   xml_attribute_t a;
+   xml_attributes_t x = attributes_get (e);
+   if (x)
+   {
+      unsigned int i = name_hash (n);
+      while ((a = x->slot[i & (x->size - 1)])
+             && (a->name != n || (a->namespace != namespace && (namespace || a->namespace != e->namespace))))
+         i++;
+      return a;
+   }
+   int c = 0;
+   for (a = e->first_attribute; a && ((a->namespace != namespace && (namespace || a->namespace != e->namespace)) || a->name != n);
+        a = a->next)
+      c++;
+   if (c > XML_ATTRIBUTE_SCAN)
+      attributes_build (e);
+   return a;
+}
+
+static void
+attribute_link (xml_t e, xml_attribute_t a)
+{                               // Add new attribute at end of element's attributes
+   a->parent = e;
+   if (e->first_attribute)
+      e->last_attribute->next = a;
+   else
+      e->first_attribute = a;
+   a->prev = e->last_attribute;
+   e->last_attribute = a;
+   xml_attributes_t x = attributes_get (e);
+   if (x)
+   {
+      if ((x->used + 1) * 2 > x->size)
+         attributes_build (e);
+      else
+         attributes_add (x, a);
+   }
+}
+
+struct xml_index_step_s
+{
+   xml_name_t name;             // NULL for any name
+   xml_namespace_t namespace;   // NULL for any name space
+};
+
+struct xml_index_entry_s
+{
+   struct xml_index_entry_s *next;
+   xml_attribute_t attribute;   // Key attribute, its parent being the element
+   unsigned int hash;           // Of the attribute content
+};
+
+struct xml_index_s
+{                               // Elements on a path by value of a key attribute
+   xml_index_t next;            // Next index on the tree
+   xml_root_t tree;
+   xml_name_t key;              // Key attribute name, interned
+   xml_namespace_t keyns;
+   int steps;                   // Steps in path from root, -1 for any element
+   struct xml_index_step_s *step;
+   struct xml_index_entry_s **hash;
+   int size,                    // Power of 2
+    count;
+};
+
+static int
+index_key (xml_index_t x, xml_attribute_t a)
+{                               // Attribute is a key for the index
+   if (a->name != x->key || (a->namespace != x->keyns && (x->keyns || a->namespace != a->parent->namespace)))
+      return 0;
+   if (x->steps < 0)
+      return 1;
+   xml_t e = a->parent;
+   int s;
+   for (s = x->steps - 1; s >= 0 && e; s--, e = e->parent)
+      if ((x->step[s].name && e->name != x->step[s].name) || (x->step[s].namespace && e->namespace != x->step[s].namespace))
+         return 0;
+   return s < 0 && !e;
+}
+
+static void
+index_add (xml_index_t x, xml_attribute_t a)
+{                               // Add at end of hash chain, so first indexed is found first (document order until keys change)
+   if (x->count >= x->size)
+   {                            // Grow and rehash
+      int n = (x->size ? : 32) * 2;
+      struct xml_index_entry_s **new = calloc (n, sizeof (*new)),
+         *i;
+      if (!new)
+         errx (1, "malloc at line %d", __LINE__);
+      int b;
+      for (b = 0; b < x->size; b++)
+         while ((i = x->hash[b]))
+         {                      // Keeps the order of entries with the same hash
+            x->hash[b] = i->next;
+            struct xml_index_entry_s **q = &new[i->hash & (n - 1)];
+            while (*q)
+               q = &(*q)->next;
+            i->next = NULL;
+            *q = i;
+         }
+      free (x->hash);
+      x->hash = new;
+      x->size = n;
+   }
+   struct xml_index_entry_s *i = malloc (sizeof (*i));
+   if (!i)
+      errx (1, "malloc at line %d", __LINE__);
+   i->next = NULL;
+   i->attribute = a;
+   i->hash = xml_hash (strlen (a->content), a->content);
+   struct xml_index_entry_s **q = &x->hash[i->hash & (x->size - 1)];
+   while (*q)
+      q = &(*q)->next;
+   *q = i;
+   x->count++;
+}
+
+static void
+index_remove (xml_index_t x, xml_attribute_t a)
+{                               // Remove if in index
+   if (!x->hash)
+      return;
+   struct xml_index_entry_s **q = &x->hash[xml_hash (strlen (a->content), a->content) & (x->size - 1)];
+   while (*q && (*q)->attribute != a)
+      q = &(*q)->next;
+   if (!*q)
+      return;
+   struct xml_index_entry_s *i = *q;
+   *q = i->next;
+   free (i);
+   x->count--;
+}
+
+static void
+index_attribute (xml_attribute_t a, int add)
+{                               // Add or remove attribute in the indexes on its tree for which it is a key
+   xml_index_t x;
+   for (x = a->parent->tree->index; x; x = x->next)
+      if (index_key (x, a))
+      {
+         if (add)
+            index_add (x, a);
+         else
+            index_remove (x, a);
+      }
+}
+
+static xml_t
+element_walk (xml_t top, xml_t e)
+{                               // Next element under top in document order after e, or NULL, by parent links so not recursing
+   if (e->first_child)
+      return e->first_child;
+   while (e != top && !e->next)
+      e = e->parent;
+   return e == top ? NULL : e->next;
+}
+
+static void
+index_element (xml_t e, int add)
+{                               // Add or remove element and those under it in the indexes on its tree, e.g. when its path changes
+   xml_t top = e;
+   for (; e; e = element_walk (top, e))
+   {
+      xml_attribute_t a;
+      for (a = e->first_attribute; a; a = a->next)
+         index_attribute (a, add);
+   }
+}
+
+static xml_namespace_t
+index_prefix (xml_root_t t, int l, const char *prefix, const char *full)
+{                               // Name space for prefix in tree
+   xml_namespacelist_t n;
+   for (n = t->namespacelist; n && (!n->tag || strncmp (n->tag, prefix, l) || n->tag[l]); n = n->next);
+   if (!n)
+      errx (1, "Cannot find prefix [%.*s:] in [%s]", l, prefix, full);
+   return n->namespace;
+}
+
+xml_index_t
+xml_index_build (xml_t tree, const char *path, const char *key)
+{                               // Index elements on path by value of key attribute
+   if (!tree)
+      errx (1, "Null tree (xml_index_build)");
+   if (!key)
+      errx (1, "Null key (xml_index_build)");
+   xml_root_t t = tree->tree;
+   xml_index_t x = xml_alloc (sizeof (*x));
+   x->tree = t;
+   const char *p = key;
+   if (*p == '@')
+      p++;
+   const char *name = p;
+   while (*p && *p != ':')
+      p++;
+   if (*p == ':')
+   {
+      x->keyns = index_prefix (t, p - name, name, key);
+      name = ++p;
+   }
+   if (!*name)
+      errx (1, "Empty key [%s]", key);
+   x->key = name_intern (t, strlen (name), name);
+   if (!path || !*path)
+      x->steps = -1;
+   else
+   {                            // Path as xml_get, relative to root, so starting with / means the first step is the root
+      int n = 2;
+      for (p = path; *p; p++)
+         if (*p == '/')
+            n++;
+      x->step = xml_alloc (sizeof (*x->step) * n);
+      p = path;
+      if (*p != '/')
+         x->steps++;            // Any root
+      while (*p)
+      {
+         while (*p == '/')
+            p++;
+         if (!*p)
+            break;
+         name = p;
+         while (*p && *p != ':' && *p != '/')
+            p++;
+         struct xml_index_step_s *step = x->step + x->steps++;
+         if (*p == ':')
+         {
+            step->namespace = index_prefix (t, p - name, name, path);
+            name = ++p;
+            while (*p && *p != ':' && *p != '/')
+               p++;
+            if (*p == ':')
+               errx (1, "Bad path, two namespace prefixes in [%s]", path);
+         }
+         if (p == name)
+            errx (1, "Empty name in path [%s]", path);
+         if (*name == '@' || (p - name == 2 && !strncmp (name, "..", 2)))
+            errx (1, "Index path has to be elements only [%s]", path);
+         if (p - name != 1 || *name != '*')
+            step->name = name_intern (t, p - name, name);
+      }
+   }
+   if (x->steps)
+   {
+      xml_t e;
+      for (e = t->root; e; e = element_walk (t->root, e))
+      {
+         xml_attribute_t a;
+         for (a = e->first_attribute; a; a = a->next)
+            if (index_key (x, a))
+               index_add (x, a);
+      }
+   }
+   x->next = t->index;
+   t->index = x;
+   return x;
+}
+
+xml_t
+xml_index_get (xml_index_t x, const char *value)
+{
+   if (!x || !value || !x->hash)
+      return NULL;
+   unsigned int h = xml_hash (strlen (value), value);
+   struct xml_index_entry_s *i;
+   for (i = x->hash[h & (x->size - 1)]; i; i = i->next)
+      if (i->hash == h && !strcmp (i->attribute->content, value))
+         return i->attribute->parent;
+   return NULL;
+}
+
+void
+xml_index_free (xml_index_t x)
 {
+   if (!x)
+      return;
+   xml_index_t *q = &x->tree->index;
+   while (*q && *q != x)
+      q = &(*q)->next;
+   if (*q)
+      *q = x->next;
+   int b;
+   for (b = 0; b < x->size; b++)
+   {
+      struct xml_index_entry_s *i;
+      while ((i = x->hash[b]))
+      {
+         x->hash[b] = i->next;
+         free (i);
+      }
+   }
+   free (x->hash);
+   free (x->step);
+   free (x);
+}
+
+xml_name_id_t
+xml_intern (xml_t tree, const char *name)
+{                               // Name interned in tree, for the _id lookups, valid until the tree is deleted
+   if (!tree)
+      return NULL;
+   return (xml_name_id_t) name_intern (tree->tree, name ? strlen (name) : 0, name);
+}
+
+xml_t
+xml_element_by_name_ns (xml_t e, xml_namespace_t namespace, const char *name)
+{                               // Names are interned, so if not in the tree there is no match, else compare pointers
    if (!e)
       return 0;
-   xml_t c = e->first_child;
-   while (c && ((namespace && c->namespace != namespace) || (name && strcmp (c->name, name))))
-      c = c->next;
-   return c;
+   if (name && !(name = name_find (e->tree, strlen (name), name)))
+      return NULL;
+   return xml_element_by_name_ns_id (e, namespace, (xml_name_id_t) name);
+}
+
+xml_t
+xml_element_by_name_ns_id (xml_t e, xml_namespace_t namespace, xml_name_id_t id)
+{
+   return xml_element_next_by_name_ns_id (e, NULL, namespace, id);
 }
 
 xml_attribute_t
@@ -768,8 +2617,21 @@ xml_attribute_by_name_ns (xml_t e, xml_namespace_t namespace, const char *name)
 {
    if (!e)
       return 0;
+   if (name && !(name = name_find (e->tree, strlen (name), name)))
+      return NULL;
+   return xml_attribute_by_name_ns_id (e, namespace, (xml_name_id_t) name);
+}
+
+xml_attribute_t
+xml_attribute_by_name_ns_id (xml_t e, xml_namespace_t namespace, xml_name_id_t id)
+{
+   if (!e)
+      return 0;
+   xml_name_t name = (xml_name_t) id;
+   if (name)
+      return attribute_find (e, namespace, name);
    xml_attribute_t a = e->first_attribute;
-   while (a && ((a->namespace != namespace && (namespace || a->namespace != e->namespace)) || (name && strcmp (a->name, name))))
+   while (a && a->namespace != namespace && (namespace || a->namespace != e->namespace))
       a = a->next;
    return a;
 }
@@ -779,13 +2641,42 @@ xml_element_next_by_name_ns (xml_t parent, xml_t prev, xml_namespace_t namespace
 {
    if (!parent)
       return 0;
-   if (prev)
-      prev = prev->next;
-   else
-      prev = parent->first_child;
-   while (prev && ((namespace && prev->namespace != namespace) || (name && strcmp (prev->name, name))))
-      prev = prev->next;
-   return prev;
+   if (name && !(name = name_find (parent->tree, strlen (name), name)))
+      return NULL;
+   return xml_element_next_by_name_ns_id (parent, prev, namespace, (xml_name_id_t) name);
+}
+
+xml_t
+xml_element_next_by_name_ns_id (xml_t parent, xml_t prev, xml_namespace_t namespace, xml_name_id_t id)
+{                               // A long scan by name indexes the children, after which same named children are linked
+   if (!parent)
+      return 0;
+   xml_name_t name = (xml_name_t) id;
+   xml_children_t x;
+   if (name && (x = children_get (parent)))
+   {
+      if (!prev)
+         prev = children_slot (x, name)->first;
+      else if (prev->name == name)
+         prev = children_next (x, prev);
+      else
+         for (prev = prev->next; prev && prev->name != name; prev = prev->next);
+      while (prev && namespace && prev->namespace != namespace)
+         prev = children_next (x, prev);
+      return prev;
+   }
+   xml_t e = (prev ? prev->next : parent->first_child);
+   int n = 0;
+   while (e && ((namespace && e->namespace != namespace) || (name && e->name != name)))
+   {
+      if (name && ++n > XML_CHILDREN_SCAN)
+      {
+         children_build (parent);
+         return xml_element_next_by_name_ns_id (parent, prev, namespace, id);
+      }
+      e = e->next;
+   }
+   return e;
 }
 
 xml_t
@@ -819,11 +2710,11 @@ xml_element_add_ns_after_l (xml_t parent, xml_namespace_t namespace, int namel,
       parent = prev->parent;
    if (prev && prev->parent != parent && prev != parent)
       errx (1, "Not siblings (xml_element_add_ns_after)");
-   xml_t e = xml_alloc (sizeof (*e));
+   xml_t e = xml_alloc_t (parent->tree, sizeof (*e));
    e->parent = parent;
    e->tree = parent->tree;
    e->namespace = (namespace ? : parent->namespace);
-   e->name = xml_dup_l (namel, name);
+   e->name = name_intern (e->tree, namel, name);
    if (!parent->first_child)
       parent->first_child = e;  // only child
    else
@@ -845,6 +2736,8 @@ xml_element_add_ns_after_l (xml_t parent, xml_namespace_t namespace, int namel,
    }
    if (!e->next)
       parent->last_child = e;   // We are last
+   if (parent->indexed)
+      children_add (parent, e, 0);
    return e;
 }
 
@@ -854,19 +2747,16 @@ xml_element_add_ns_after (xml_t parent, xml_namespace_t namespace, const char *n
    return xml_element_add_ns_after_l (parent, namespace, strlen (name ? : ""), name, prev);
 }
 
-xml_attribute_t
-xml_attribute_set_ns_l (xml_t e, xml_namespace_t namespace, int namel, const char *name, int contentl, const char *content)
-{
+static xml_attribute_t
+attribute_set (xml_t e, xml_namespace_t namespace, int namel, const char *name, int contentl, const char *content, int insitu)
+{                               // Set attribute, if insitu then content is null terminated and in tree storage so not copied
    if (!name)
       errx (1, "Null name (xml_attribute_set_ns)");
    if (!e)
       errx (1, "Null element xml_attribute_set_ns)");
    // see if exists
-   xml_attribute_t a = e->first_attribute;
-   while (a
-          && ((a->namespace != namespace && (namespace || a->namespace != e->namespace))
-              || (name && strcmp_l (strlen (a->name ? : ""), a->name, namel, name))))
-      a = a->next;
+   xml_name_t n = content ? name_intern (e->tree, namel, name) : name_find (e->tree, namel, name);
+   xml_attribute_t a = n ? attribute_find (e, namespace, n) : NULL;
    if (!content)
    {
       if (a)
@@ -875,27 +2765,33 @@ xml_attribute_set_ns_l (xml_t e, xml_namespace_t namespace, int namel, const cha
    }
    if (a)
    {                            // change content
-      xml_content_t new = xml_dup_l (contentl, content);
-      xml_free (a->content);
+      xml_content_t new = insitu ? (char *) content : xml_dup_t (e->tree, contentl, content);
+      if (e->tree->index)
+         index_attribute (a, 0);
+      xml_free_s (e->tree, a->content);
       a->content = new;
+      if (e->tree->index)
+         index_attribute (a, 1);
       return a;
    }
    // new attribute
-   a = xml_alloc (sizeof (*a));
-   a->parent = e;
-   if (e->first_attribute)
-      e->last_attribute->next = a;
-   else
-      e->first_attribute = a;
-   a->prev = e->last_attribute;
-   e->last_attribute = a;
-   a->name = xml_dup_l (namel, name);
-   a->content = xml_dup (content);
+   a = xml_alloc_t (e->tree, sizeof (*a));
+   a->name = n;
    if (namespace)
       a->namespace = namespace;
+   attribute_link (e, a);
+   a->content = insitu ? (char *) content : xml_dup_t (e->tree, contentl, content);
+   if (e->tree->index)
+      index_attribute (a, 1);
    return a;
 }
 
+xml_attribute_t
+xml_attribute_set_ns_l (xml_t e, xml_namespace_t namespace, int namel, const char *name, int contentl, const char *content)
+{
+   return attribute_set (e, namespace, namel, name, contentl, content, 0);
+}
+
 xml_attribute_t
 xml_attribute_set_ns (xml_t e, xml_namespace_t namespace, const char *name, const char *content)
 {
@@ -907,6 +2803,8 @@ xml_element_delete (xml_t e)
 {                               // delete an element and all subordinate elements
    if (!e)
       return NULL;
+   if (e->parent && e->parent->indexed)
+      children_remove (e->parent, e);
    if (e->prev)
       e->prev->next = e->next;
    else if (e->parent)
@@ -915,44 +2813,72 @@ xml_element_delete (xml_t e)
       e->next->prev = e->prev;
    else if (e->parent)
       e->parent->last_child = e->prev;
-   // Delete attributes
-   xml_attribute_t a = e->first_attribute;
-   while (a)
-   {
-      xml_attribute_t n = a->next;
-      xml_attribute_delete (a);
-      a = n;
-   }
-   // Delete children
-   xml_t c = e->first_child;
-   while (c)
+   // Delete from the bottom up, each element once its children are gone
+   xml_t top = e;
+   while (1)
    {
-      xml_t n = c->next;
-      xml_element_delete (c);
-      c = n;
+      children_drop (e->tree, e);       // so children need not be removed from it
+      if (e->first_child)
+      {
+         e = e->first_child;
+         continue;
+      }
+      // Delete attributes
+      attributes_drop (e->tree, e);
+      xml_attribute_t a = e->first_attribute;
+      while (a)
+      {
+         xml_attribute_t n = a->next;
+         xml_attribute_delete (a);
+         a = n;
+      }
+      // Clean up element
+      e->name = NULL;           // Interned
+      e->content = xml_free_s (e->tree, e->content);
+      e->namespace = NULL;
+      if (e == top)
+         break;
+      xml_t p = e->parent;
+      p->first_child = e->next;
+      if (e->next)
+         e->next->prev = NULL;
+      else
+         p->last_child = NULL;
+      xml_free_s (e->tree, e);
+      e = p->first_child ? : p;
    }
-   // Clean up element
-   e->name = xml_free (e->name);
-   e->content = xml_free (e->content);
-   e->namespace = NULL;
    if (e->parent)
-      xml_free (e);             // Else leave in place as empty root element on tree
+      xml_free_s (e->tree, e);  // Else leave in place as empty root element on tree
    return NULL;
 }
 
 xml_t
 xml_element_duplicate (xml_t e)
 {
-   void copy (xml_t x, xml_t e)
-   {
-      xml_element_set_content (x, e->content);
+   xml_t x = xml_element_add_ns_after (e->parent, e->namespace, e->name, e),
+     top = e,
+     c = x;                     // Copy of e
+   while (1)
+   {                            // c follows e in the copy
+      xml_element_set_content (c, e->content);
       for (xml_attribute_t a = e->first_attribute; a; a = a->next)
-         xml_attribute_set (x, a->name, a->content);
-      for (xml_t c = e->first_child; c; c = c->next)
-         copy (xml_element_add_ns (x, c->namespace, c->name), c);
+         xml_attribute_set (c, a->name, a->content);
+      if (e->first_child)
+      {
+         e = e->first_child;
+         c = xml_element_add_ns (c, e->namespace, e->name);
+         continue;
+      }
+      while (e != top && !e->next)
+      {
+         e = e->parent;
+         c = c->parent;
+      }
+      if (e == top)
+         break;
+      e = e->next;
+      c = xml_element_add_ns (c->parent, e->namespace, e->name);
    }
-   xml_t x = xml_element_add_ns_after (e->parent, e->namespace, e->name, e);
-   copy (x, e);
    return x;
 }
 
@@ -961,6 +2887,12 @@ xml_element_explode (xml_t e)
 {                               // delete an element but making its subordinate elements take its place
    if (!e)
       errx (1, "No element to explode (xml_element_explode)");
+   if (e->parent && e->parent->indexed)
+      children_remove (e->parent, e);
+   children_drop (e->tree, e);
+   attributes_drop (e->tree, e);
+   if (e->tree->index)
+      index_element (e, 0);     // Paths change
    if (e->prev)
       e->prev->next = e->next;
    else if (e->parent)
@@ -996,10 +2928,15 @@ xml_element_explode (xml_t e)
          e->last_child->next = e->next;
       } else if (e->parent)
          e->parent->last_child = e->last_child;
+      if (e->parent && e->parent->indexed)
+         for (c = e->first_child; c != e->next; c = c->next)
+            children_add (e->parent, c, 0);
+      if (e->tree->index)
+         for (c = e->first_child; c != e->next; c = c->next)
+            index_element (c, 1);
    }
-   xml_free (e->name);
-   xml_free (e->content);
-   xml_free (e);
+   xml_free_s (e->tree, e->content);
+   xml_free_s (e->tree, e);
 }
 
 void
@@ -1007,6 +2944,11 @@ xml_attribute_delete (xml_attribute_t a)
 {
    if (!a)
       errx (1, "Null attribute (xml_attribute_delete)");
+   xml_attributes_t x = attributes_get (a->parent);
+   if (x)
+      attributes_remove (x, a);
+   if (a->parent->tree && a->parent->tree->index)
+      index_attribute (a, 0);
    if (a->prev)
       a->prev->next = a->next;
    else
@@ -1015,25 +2957,43 @@ xml_attribute_delete (xml_attribute_t a)
       a->next->prev = a->prev;
    else
       a->parent->last_attribute = a->prev;
-   xml_free (a->name);
-   xml_free (a->content);
-   xml_free (a);
+   xml_free_s (a->parent->tree, a->content);
+   xml_free_s (a->parent->tree, a);
 }
 
-xml_t
-xml_tree_new (const char *name)
+static xml_t
+tree_new (const char *name, int arena)
 {                               // Create a new tree - return the (unnamed) root
-   xml_root_t tree = xml_alloc (sizeof (*tree));
+   xml_root_t tree;
+   if (arena)
+   {                            // Tree is the first thing in its arena
+      xml_arena_t a = NULL;
+      tree = memset (arena_alloc (&a, sizeof (*tree), 8), 0, sizeof (*tree));
+      tree->arena = a;
+   } else
+      tree = xml_alloc (sizeof (*tree));
    tree->encoding = "UTF-8";
-   xml_t e = xml_alloc (sizeof (*e));
+   xml_t e = xml_alloc_t (tree, sizeof (*e));
    tree->root = e;
    e->tree = tree;
    if (name)
-      e->name = xml_dup (name);
+      e->name = name_intern (tree, strlen (name), name);
    xml_namespace (e, "xml", "http://www.w3.org/XML/1998/namespace");
    return e;
 }
 
+xml_t
+xml_tree_new (const char *name)
+{
+   return tree_new (name, 0);
+}
+
+xml_t
+xml_tree_new_arena (const char *name)
+{                               // Create a new tree allocated in an arena, individual deletes do not release storage
+   return tree_new (name, 1);
+}
+
 xml_t
 xml_tree_add_root_ns (xml_t e, xml_namespace_t namespace, const char *name)
 {                               // Rename root and namespace root - trees always have roots now
@@ -1042,13 +3002,64 @@ xml_tree_add_root_ns (xml_t e, xml_namespace_t namespace, const char *name)
    e->namespace = namespace;
    if (name)
    {
-      if (e->name)
-         e->name = xml_free (e->name);
-      e->name = xml_dup (name);
+      e->name = name_intern (tree, strlen (name), name);
    }
    return e;
 }
 
+static xml_namespacelist_t
+namespace_find (xml_root_t t, unsigned int l, const char *uri)
+{                               // Find name space in tree by URI
+   xml_namespacelist_t n;
+   if (!t->nshash)
+   {                            // Few enough to just scan
+      for (n = t->namespacelist; n; n = n->next)
+         if (strlen (n->namespace->uri) == l && !strncmp (n->namespace->uri, uri, l))
+            return n;
+      return NULL;
+   }
+   for (n = t->nshash[xml_hash (l, uri) & (t->nshashn - 1)]; n; n = n->hash)
+      if (strlen (n->namespace->uri) == l && !strncmp (n->namespace->uri, uri, l))
+         return n;
+   return NULL;
+}
+
+static xml_namespacelist_t
+namespace_add (xml_root_t t, unsigned int l, const char *uri)
+{                               // Add new name space to end of tree list, and hash
+   xml_namespacelist_t n = xml_alloc_t (t, sizeof (*n));
+   n->namespace = xml_alloc_t (t, sizeof (*n->namespace) + l + 1);
+   strncpy (n->namespace->uri, uri, l);
+   if (t->namespacelist)
+      t->namespacelist_end->next = n;
+   else
+      t->namespacelist = n;
+   t->namespacelist_end = n;
+   if (++t->namespaces <= 8)
+      return n;                 // Not worth hashing yet
+   if (t->namespaces > t->nshashn)
+   {                            // Grow and rehash
+      free (t->nshash);
+      t->nshashn = (t->nshashn ? : 8) * 2;
+      t->nshash = calloc (t->nshashn, sizeof (*t->nshash));
+      if (!t->nshash)
+         errx (1, "malloc at line %d", __LINE__);
+      xml_namespacelist_t q;
+      for (q = t->namespacelist; q; q = q->next)
+      {
+         xml_namespacelist_t *h = &t->nshash[xml_hash (strlen (q->namespace->uri), q->namespace->uri) & (t->nshashn - 1)];
+         q->hash = *h;
+         *h = q;
+      }
+   } else
+   {
+      xml_namespacelist_t *h = &t->nshash[xml_hash (strlen (n->namespace->uri), n->namespace->uri) & (t->nshashn - 1)];
+      n->hash = *h;
+      *h = n;
+   }
+   return n;
+}
+
 xml_namespace_t
 xml_namespace_l (xml_t tree, int tagl, const char *tag, unsigned int namespacel, const char *namespace)
 {
@@ -1057,24 +3068,12 @@ xml_namespace_l (xml_t tree, int tagl, const char *tag, unsigned int namespacel,
       return NULL;
    if (!t)
       errx (1, "Null tree (xml_namespace)");
-   xml_namespacelist_t l = t->namespacelist;
-   while (l && (strlen (l->namespace->uri) != namespacel || strncmp (l->namespace->uri, namespace, namespacel)))
-      l = l->next;
+   xml_namespacelist_t l = namespace_find (t, namespacel, namespace);
    if (!l)
-   {
-      l = xml_alloc (sizeof (*l));
-      l->namespace = xml_alloc (sizeof (*l->namespace) + namespacel + 1);
-      strncpy (l->namespace->uri, namespace, namespacel);
-      if (t->namespacelist)
-         t->namespacelist_end->next = l;
-      else
-         t->namespacelist = l;
-      t->namespacelist_end = l;
-   }
+      l = namespace_add (t, namespacel, namespace);
    if (tag)
    {
       //if (l->namespace->fixed && l->tag && strcmp (l->tag, tag)) errx (1, "Two tags for ns %s (%s/%s)", namespace, tag, l->tag);
-      xml_free (l->tag);
       l->namespace->fixed = 1;
       while (tagl && *tag && strchr (":^*", *tag))
       {                         // prefixes
@@ -1097,7 +3096,7 @@ xml_namespace_l (xml_t tree, int tagl, const char *tag, unsigned int namespacel,
             tagl--;
          }
       }
-      l->tag = xml_dup_l (tagl, tag);
+      l->tag = name_intern (t, tagl, tag);
    }
    return l->namespace;
 }
@@ -1123,14 +3122,25 @@ xml_pi_delete (xml_pi_t p)
       p->next->prev = p->prev;
    else
       p->tree->last_pi = p->prev;
-   xml_free (p->name);
-   xml_free (p->content);
-   xml_free (p);
+   xml_free_s (p->tree, p->name);
+   xml_free_s (p->tree, p->content);
+   xml_free_s (p->tree, p);
 }
 
 static xml_t
 xml_real_tree_delete (xml_root_t t)
 {
+   while (t->index)
+      xml_index_free (t->index);
+   if (t->arena)
+   {                            // Everything else is in the arena, including the tree
+      free (t->nshash);
+      name_free (t);
+      xml_free (t->buffer);
+      arena_free (t->arenatext);
+      arena_free (t->arena);
+      return NULL;
+   }
    if (t->root)
    {
       xml_element_delete (t->root);
@@ -1141,10 +3151,11 @@ xml_real_tree_delete (xml_root_t t)
    {
       xml_namespacelist_t n = l->next;
       xml_free ((char *) l->namespace);
-      xml_free (l->tag);
       xml_free (l);
       l = n;
    }
+   free (t->nshash);
+   name_free (t);
    xml_pi_t p = t->first_pi;
    while (p)
    {
@@ -1152,14 +3163,9 @@ xml_real_tree_delete (xml_root_t t)
       xml_pi_delete (p);
       p = n;
    }
-   xml_stringlist_t s = t->strings;
-   while (s)
-   {
-      xml_stringlist_t n = s->next;
-      xml_free (s->string);
-      xml_free (s);
-      s = n;
-   }
+   xml_free (t->buffer);
+   xml_free (t->children);     // Emptied as the elements were deleted
+   xml_free (t->attributes);
    xml_free (t);
    return NULL;
 }
@@ -1175,35 +3181,118 @@ xml_tree_delete (xml_t tree)
 static void
 change_namespace (xml_t e, xml_namespace_t o, xml_namespace_t n, xml_root_t t)
 {
-   e->tree = t;
-   if (e->namespace == o)
-      e->namespace = n;
-   xml_attribute_t a = e->first_attribute;
-   while (a)
+   xml_t top = e;
+   for (; e; e = element_walk (top, e))
    {
-      if (a->namespace == o)
-         a->namespace = n;
-      a = a->next;
+      e->tree = t;
+      if (e->namespace == o)
+         e->namespace = n;
+      xml_attribute_t a = e->first_attribute;
+      while (a)
+      {
+         if (a->namespace == o)
+            a->namespace = n;
+         a = a->next;
+      }
    }
-   xml_t c = e->first_child;
-   while (c)
+}
+
+static void
+copy_owned (xml_t e, xml_root_t t)
+{                               // Copy content in storage owned by tree t, as element is leaving it (names are interned again by update_treerefs)
+   xml_t top = e;
+   for (; e; e = element_walk (top, e))
    {
-      change_namespace (c, o, n, t);
-      c = c->next;
+      if (xml_owned (t, e->content))
+         e->content = xml_dup (e->content);
+      xml_attribute_t a;
+      for (a = e->first_attribute; a; a = a->next)
+         if (xml_owned (t, a->content))
+            a->content = xml_dup (a->content);
    }
 }
 
+static xml_t
+element_copy_one (xml_t e, xml_root_t t)
+{                               // Copy of element and its attributes allocated in tree t, not linked
+   xml_t n = xml_alloc_t (t, sizeof (*n));
+   n->tree = t;
+   n->namespace = e->namespace;
+   n->name = name_intern (t, strlen (e->name ? : ""), e->name);
+   n->content = xml_dup_t (t, strlen (e->content ? : ""), e->content);
+   n->filename = e->filename;
+   n->line = e->line;
+   n->json_single = e->json_single;
+   n->json_unquoted = e->json_unquoted;
+   xml_attribute_t a;
+   for (a = e->first_attribute; a; a = a->next)
+   {
+      xml_attribute_t b = xml_alloc_t (t, sizeof (*b));
+      b->parent = n;
+      b->namespace = a->namespace;
+      b->json_unquoted = a->json_unquoted;
+      b->name = name_intern (t, strlen (a->name ? : ""), a->name);
+      b->content = xml_dup_t (t, strlen (a->content ? : ""), a->content);
+      if (n->first_attribute)
+         n->last_attribute->next = b;
+      else
+         n->first_attribute = b;
+      b->prev = n->last_attribute;
+      n->last_attribute = b;
+   }
+   return n;
+}
+
+static xml_t
+element_copy (xml_t e, xml_root_t t)
+{                               // Copy of detached element and all under it allocated in tree t, name spaces left as in old tree
+   xml_t top = e,
+     n = element_copy_one (e, t),
+     c = n;                     // Copy of e
+   while (1)
+   {                            // c follows e in the copy
+      xml_t p = c;              // Copy of parent for next element
+      if (e->first_child)
+         e = e->first_child;
+      else
+      {
+         while (e != top && !e->next)
+         {
+            e = e->parent;
+            c = c->parent;
+         }
+         if (e == top)
+            break;
+         e = e->next;
+         p = c->parent;
+      }
+      c = element_copy_one (e, t);
+      c->parent = p;
+      if (p->first_child)
+         p->last_child->next = c;
+      else
+         p->first_child = c;
+      c->prev = p->last_child;
+      p->last_child = c;
+   }
+   return n;
+}
+
 static void
 update_treerefs (xml_t e, xml_root_t t)
 {
-   e->tree = t;
-   if (e->filename)
-      e->filename = savestring (e->filename, strlen (e->filename), t);
-   e = e->first_child;
-   while (e)
+   xml_t top = e;
+   for (; e; e = element_walk (top, e))
    {
-      update_treerefs (e, t);
-      e = e->next;
+      children_drop (e->tree, e);       // Names change
+      attributes_drop (e->tree, e);
+      e->tree = t;
+      if (e->filename)
+         e->filename = name_intern (t, strlen (e->filename), e->filename);
+      e->name = name_intern (t, strlen (e->name ? : ""), e->name);
+      xml_attribute_t a;
+      for (a = e->first_attribute; a; a = a->next)
+         a->name = name_intern (t, strlen (a->name), a->name);
    }
 }
 
@@ -1212,7 +3301,8 @@ xml_element_attach_after (xml_t pe, xml_t prev, xml_t e)
 {
    // Detaches e from its tree, and attaches it under pe
    // if e is root element, then copies e first and clears e as empty root, leaving e still valid as tree pointer and safe to delete
-   // Returns the attached element, usually the same as e, unless it was root
+   // Returns the attached element, the same as e unless it was root
+   // Moving a non root element between trees where either uses an arena barfs, as its storage cannot be moved
    // At present, attaching under empty root barfs, but in future may replace it
    if (!pe && prev)
       pe = prev->parent;
@@ -1224,8 +3314,23 @@ xml_element_attach_after (xml_t pe, xml_t prev, xml_t e)
    xml_root_t t = e->tree;
    if (pt == t && !e->parent)
       errx (1, "Moving root of same tree (xml_element_attach)");
+   if (t && t != pt && (t->arena || pt->arena) && e->parent)
+      errx (1, "Moving element in or out of an arena tree (xml_element_attach)");
+   if (t && t->index)
+      index_element (e, 0);
    // detach from old parent
-   if (!e->parent)
+   if (t && t != pt && (t->arena || pt->arena))
+   {                            // Root, cannot move storage in or out of an arena, so copy and delete the original, leaving it as empty root
+      xml_t n = element_copy (e, pt);
+      if (!e->parent)
+      {
+         e->line = 0;
+         e->json_single = 0;
+         e->filename = NULL;
+      }
+      xml_element_delete (e);
+      e = n;
+   } else if (!e->parent)
    {                            // root
       if (t)
       {                         // In theory could be a detached element,
@@ -1241,6 +3346,8 @@ xml_element_attach_after (xml_t pe, xml_t prev, xml_t e)
          m (last_attribute);
          m (filename);
 #undef m
+         children_drop (t, e);
+         attributes_drop (t, e);
          n->line = e->line;
          e->line = 0;
          n->json_single = e->line;
@@ -1255,6 +3362,8 @@ xml_element_attach_after (xml_t pe, xml_t prev, xml_t e)
       }
    } else
    {
+      if (e->parent->indexed)
+         children_remove (e->parent, e);
       if (e->prev)
          e->prev->next = e->next;
       else if (e->parent)
@@ -1272,9 +3381,7 @@ xml_element_attach_after (xml_t pe, xml_t prev, xml_t e)
       while (o)
       {
          xml_namespace_t new = 0;
-         xml_namespacelist_t n = pt->namespacelist;
-         while (n && strcmp (n->namespace ? n->namespace->uri : "", o->namespace ? o->namespace->uri : ""))
-            n = n->next;
+         xml_namespacelist_t n = namespace_find (pt, strlen (o->namespace->uri), o->namespace->uri);
          if (!n)
             new = xml_namespace (pe, 0, o->namespace->uri);
          else
@@ -1285,7 +3392,11 @@ xml_element_attach_after (xml_t pe, xml_t prev, xml_t e)
    }
    // Fix tree reference
    if (t != pt)
+   {
+      if (t && t->buffer)
+         copy_owned (e, t);
       update_treerefs (e, pt);  // Set tree refs
+   }
    // attach to new tree
    if (!pe->parent && !pe->name && !pe->prev && !pe->next && !pe->first_child && !pe->first_attribute)
    {                            // pe is a lone null root
@@ -1324,6 +3435,10 @@ xml_element_attach_after (xml_t pe, xml_t prev, xml_t e)
       }
    }
    e->parent = pe;
+   if (pe->indexed)
+      children_add (pe, e, 0);
+   if (pt->index)
+      index_element (e, 1);
    return e;
 }
 
@@ -1528,14 +3643,16 @@ sort_attributes (xml_t e)
 static void
 count_namespace_e (xml_t e)
 {
-   if (e->namespace)
-      e->namespace->count++;
-   xml_attribute_t a;
-   for (a = e->first_attribute; a; a = a->next)
-      if (a->namespace)
-         a->namespace->count++;
-   for (e = e->first_child; e; e = e->next)
-      count_namespace_e (e);
+   xml_t top = e;
+   for (; e; e = element_walk (top, e))
+   {
+      if (e->namespace)
+         e->namespace->count++;
+      xml_attribute_t a;
+      for (a = e->first_attribute; a; a = a->next)
+         if (a->namespace)
+            a->namespace->count++;
+   }
 }
 
 static void
@@ -1549,9 +3666,16 @@ count_namespace (xml_t e)
 
 static void
 write_element (FILE * fp, xml_t e, int indent, xml_namespace_t defns)
-{
+{                               // Write element and all under it, stacking what is needed to close each open element
    xml_root_t t = e->tree;
-   if (e->name && *e->name)
+   struct
+   {                            // Open elements with children
+      int indent;
+      xml_namespace_t defns;    // Default name space in the element, and so for its children
+   } *stack = NULL;
+   int depth = 0,
+     stacka = 0;
+   void indentation (int indent)
    {
       if (indent > 0)
       {
@@ -1559,129 +3683,163 @@ write_element (FILE * fp, xml_t e, int indent, xml_namespace_t defns)
          while (i--)
             fputc (' ', fp);
       }
-      xml_namespace_t wasdef = NULL;    // replaced def namespace
-      {                         // change defns?
-         count_namespace (e);
-         xml_namespacelist_t ns;
-         xml_namespace_t b = defns;
-         for (ns = t->namespacelist; ns; ns = ns->next)
-            if ((!ns->namespace->fixed || !*ns->tag) && ns->namespace->parent == e && (!b || b->count < ns->namespace->count))
-               b = ns->namespace;
-         if (b && b != defns)
-         {
-            if (defns && defns->count)
-               wasdef = defns;
-            defns = b;
-         }
-      }
-      fputc ('<', fp);
-      if (e->namespace != defns)
-         write_namespace (fp, e->namespace);
-      write_name (fp, e->name);
-      {                         // namespaces
-         xml_namespacelist_t ns;
-         if (defns && (defns->parent == e || indent == -1))
-         {
-            fputc (' ', fp);
-            write_name (fp, "xmlns");
-            fputc ('=', fp);
-            fputc ('"', fp);
-            if (defns && defns->parent == e)
-               xml_quoted (fp, defns->uri);
-            fputc ('"', fp);
-         }
-         for (ns = t->namespacelist; ns; ns = ns->next)
-            if (ns->namespace != defns && (ns->namespace->parent == e || ns->namespace == wasdef) && ns->namespace->count
-                && *ns->namespace->uri)
+   }
+   void end_tag (xml_t e, xml_namespace_t defns)
+   {
+      if (e->name && *e->name)
+      {
+         fputc ('<', fp);
+         fputc ('/', fp);
+         if (e->namespace != defns)
+            write_namespace (fp, e->namespace);
+         write_name (fp, e->name);
+         fputc ('>', fp);
+      }
+   }
+   xml_t top = e;
+   while (1)
+   {
+      if (depth)
+      {                         // Child of the open element on top of the stack
+         indent = stack[depth - 1].indent < 0 ? stack[depth - 1].indent - 1 : stack[depth - 1].indent + 3;
+         defns = stack[depth - 1].defns;
+      }
+      if (e->name && *e->name)
+      {
+         indentation (indent);
+         xml_namespace_t wasdef = NULL; // replaced def namespace
+         {                      // change defns?
+            xml_namespacelist_t ns;
+            for (ns = t->namespacelist; ns && ns->namespace->parent != e; ns = ns->next);
+            if (ns)
+            {                   // Name spaces are counted under elements where one is declared, only they can change defns
+               count_namespace (e);
+               xml_namespace_t b = defns;
+               for (ns = t->namespacelist; ns; ns = ns->next)
+                  if ((!ns->namespace->fixed || !*ns->tag) && ns->namespace->parent == e && (!b || b->count < ns->namespace->count))
+                     b = ns->namespace;
+               if (b && b != defns)
+               {
+                  if (defns && defns->count)
+                     wasdef = defns;
+                  defns = b;
+               }
+            }
+         }
+         fputc ('<', fp);
+         if (e->namespace != defns)
+            write_namespace (fp, e->namespace);
+         write_name (fp, e->name);
+         {                      // namespaces
+            xml_namespacelist_t ns;
+            if (defns && (defns->parent == e || indent == -1))
             {
                fputc (' ', fp);
                write_name (fp, "xmlns");
-               fputc (':', fp);
-               write_name (fp, ns->tag);
                fputc ('=', fp);
                fputc ('"', fp);
-               if (ns->namespace)
-                  xml_quoted (fp, ns->namespace->uri);
+               if (defns && defns->parent == e)
+                  xml_quoted (fp, defns->uri);
                fputc ('"', fp);
             }
-      }
-      if (indent == -1)
-         sort_attributes (e);
-      xml_attribute_t a = e->first_attribute;
-      while (a)
-      {
-         if (strncmp (a->name, "xmlns", 5) || ((a->name)[5] != ':' && (a->name)[5]))
-         {
-            fputc (' ', fp);
-            if (a->namespace && a->namespace != defns)
-               write_namespace (fp, a->namespace);
-            write_name (fp, a->name);
-            fputc ('=', fp);
-            fputc ('"', fp);
-            xml_quoted (fp, a->content);
-            fputc ('"', fp);
-         }
-         a = a->next;
-      }
-   }
-   char *content = e->content;
-   if (indent >= 0 && content && e->first_child)
-   {                            // If only white space around other sub elements, do not consider as content
-      char *p = content;
-      while (*p == ' ' || *p == 9 || *p == 10 || *p == 13)
-         p++;
-      if (!*p)
-         content = NULL;
-   }
-   if (content || e->first_child || indent < 0)
-   {
-      if (e->name && *e->name)
-         fputc ('>', fp);
-      if (!e->name && content)
-         fprintf (fp, "%s", content);   // bodge for raw XML inclusions (HMRC DPS crap)
-      else if (content)
-         write_content (fp, content);
-      xml_t c = e->first_child;
-      if (c)
-      {
-         if (indent >= 0)
-            fputc ('\n', fp);
-         while (c)
-         {
-            write_element (fp, c, indent < 0 ? indent - 1 : indent + 3, defns);
-            c = c->next;
+            for (ns = t->namespacelist; ns; ns = ns->next)
+               if (ns->namespace != defns && (ns->namespace->parent == e || ns->namespace == wasdef) && ns->namespace->count
+                   && *ns->namespace->uri)
+               {
+                  fputc (' ', fp);
+                  write_name (fp, "xmlns");
+                  fputc (':', fp);
+                  write_name (fp, ns->tag);
+                  fputc ('=', fp);
+                  fputc ('"', fp);
+                  if (ns->namespace)
+                     xml_quoted (fp, ns->namespace->uri);
+                  fputc ('"', fp);
+               }
          }
-         if (indent > 0)
+         if (indent == -1)
+            sort_attributes (e);
+         xml_attribute_t a = e->first_attribute;
+         while (a)
          {
-            int i = indent;
-            while (i--)
+            if (strncmp (a->name, "xmlns", 5) || ((a->name)[5] != ':' && (a->name)[5]))
+            {
                fputc (' ', fp);
+               if (a->namespace && a->namespace != defns)
+                  write_namespace (fp, a->namespace);
+               write_name (fp, a->name);
+               fputc ('=', fp);
+               fputc ('"', fp);
+               xml_quoted (fp, a->content);
+               fputc ('"', fp);
+            }
+            a = a->next;
          }
       }
-      if (e->name && *e->name)
+      char *content = e->content;
+      if (indent >= 0 && content && e->first_child)
+      {                         // If only white space around other sub elements, do not consider as content
+         char *p = content;
+         while (*p == ' ' || *p == 9 || *p == 10 || *p == 13)
+            p++;
+         if (!*p)
+            content = NULL;
+      }
+      if (content || e->first_child || indent < 0)
       {
-         fputc ('<', fp);
-         fputc ('/', fp);
-         if (e->namespace != defns)
-            write_namespace (fp, e->namespace);
-         write_name (fp, e->name);
+         if (e->name && *e->name)
+            fputc ('>', fp);
+         if (!e->name && content)
+            fprintf (fp, "%s", content);        // bodge for raw XML inclusions (HMRC DPS crap)
+         else if (content)
+            write_content (fp, content);
+         if (e->first_child)
+         {                      // Children written next, closed when coming back up
+            if (indent >= 0)
+               fputc ('\n', fp);
+            if (depth == stacka)
+            {
+               stacka = stacka * 2 + 16;
+               stack = realloc (stack, sizeof (*stack) * stacka);
+               if (!stack)
+                  errx (1, "malloc at line %d", __LINE__);
+            }
+            stack[depth].indent = indent;
+            stack[depth].defns = defns;
+            depth++;
+            e = e->first_child;
+            continue;
+         }
+         end_tag (e, defns);
+      } else if (e->name && *e->name)
+      {                         // self closing
+         if (*e->name == '?')
+            fputc ('?', fp);    // inline processing directive?!?
+         else
+            fputc ('/', fp);
          fputc ('>', fp);
       }
-   } else if (e->name && *e->name)
-   {                            // self closing
-      if (*e->name == '?')
-         fputc ('?', fp);       // inline processing directive?!?
-      else
-         fputc ('/', fp);
-      fputc ('>', fp);
+      if (indent >= 0)
+         fputc ('\n', fp);
+      while (e != top && !e->next)
+      {                         // Close parents
+         e = e->parent;
+         depth--;
+         indentation (stack[depth].indent);
+         end_tag (e, stack[depth].defns);
+         if (stack[depth].indent >= 0)
+            fputc ('\n', fp);
+      }
+      if (e == top)
+         break;
+      e = e->next;
    }
-   if (indent >= 0)
-      fputc ('\n', fp);
+   free (stack);
 }
 
 static void
-ns_used (xml_namespace_t n, xml_t e, int l)
-{
+ns_used (xml_namespace_t n, xml_t e, int l, xml_t * path)
+{                               // path is the element at each level down to e
    if (!n)
       return;
    if (!n->parent || l < n->level)
@@ -1690,11 +3848,8 @@ ns_used (xml_namespace_t n, xml_t e, int l)
       n->level = l;
       return;
    }
-   while (l > n->level)
-   {
-      e = e->parent;
-      l--;
-   }
+   l = n->level;
+   e = path[l];
    if (e == n->parent)
       return;
    xml_t p = n->parent;
@@ -1709,15 +3864,42 @@ ns_used (xml_namespace_t n, xml_t e, int l)
 }
 
 static void
-scan_namespace_element (xml_t e, int l)
-{
-   l++;
-   ns_used (e->namespace, e, l);
-   xml_attribute_t a;
-   for (a = e->first_attribute; a; a = a->next)
-      ns_used (a->namespace, e, l);
-   for (e = e->first_child; e; e = e->next)
-      scan_namespace_element (e, l);
+scan_namespace_element (xml_t e)
+{                               // Keeps the path down to each element to find common parents quickly
+   xml_t top = e,
+     *path = NULL;
+   int l = 1,
+     patha = 0;
+   while (1)
+   {
+      if (l >= patha)
+      {
+         patha = patha * 2 + 16;
+         path = realloc (path, sizeof (*path) * patha);
+         if (!path)
+            errx (1, "malloc at line %d", __LINE__);
+      }
+      path[l] = e;
+      ns_used (e->namespace, e, l, path);
+      xml_attribute_t a;
+      for (a = e->first_attribute; a; a = a->next)
+         ns_used (a->namespace, e, l, path);
+      if (e->first_child)
+      {
+         e = e->first_child;
+         l++;
+         continue;
+      }
+      while (e != top && !e->next)
+      {
+         e = e->parent;
+         l--;
+      }
+      if (e == top)
+         break;
+      e = e->next;
+   }
+   free (path);
 }
 
 static void
@@ -1729,7 +3911,7 @@ scan_namespace (xml_root_t t, xml_t r)
       ns->namespace->level = 0;
       ns->namespace->parent = NULL;
    }
-   scan_namespace_element (r, 0);
+   scan_namespace_element (r);
    for (ns = t->namespacelist; ns; ns = ns->next)
       if (ns->namespace->always || (ns->namespace->nsroot && ns->namespace->parent))
          ns->namespace->parent = t->root;
@@ -1783,7 +3965,6 @@ xml_element_write (FILE * fp, xml_t e, int headers, int pack)
             for (b = t->namespacelist; b && b != a && strcmp (a->tag ? : "", b->tag ? : ""); b = b->next);
             if (b && b != a)
             {
-               xml_free (a->tag);
                a->tag = 0;
             }
          }
@@ -1807,7 +3988,7 @@ xml_element_write (FILE * fp, xml_t e, int headers, int pack)
                if (!b || b == a)
                   break;
             }
-            a->tag = xml_dup (temp);
+            a->tag = name_intern (t, strlen (temp), temp);
          }
       }
    }
@@ -1852,39 +4033,31 @@ xml_element_write_json (FILE * fp, xml_t e)
       if (!unquoted)
          fputc ('"', fp);
    }
-   if (!xml_element_next (e, NULL) && !xml_attribute_next (e, NULL))
-   {                            // Content only
-      char *c = xml_element_content (e);
-      if (c)
-         string (c, 0, e->json_unquoted);
-      else
-         fprintf (fp, "null");
-      return;
-   }
-   xml_t q;
-   xml_attribute_t a;
-   char sep = 0;
-   a = NULL;
-   while ((a = xml_attribute_next (e, a)))
-   {
-      if (sep)
-         fputc (sep, fp);
-      else
-      {
-         fputc ('{', fp);
-         sep = ',';
+   struct
+   {                            // Open objects
+      xml_t e;
+      xml_t q;                  // First of the name being written
+      xml_t z;                  // Last written of that name
+      char sep;
+      char sep2;
+   } *stack = NULL;
+   int depth = 0,
+     stacka = 0;
+   void value (xml_t e)
+   {                            // Write content, or start object and stack it
+      if (!xml_element_next (e, NULL) && !xml_attribute_next (e, NULL))
+      {                         // Content only
+         char *c = xml_element_content (e);
+         if (c)
+            string (c, 0, e->json_unquoted);
+         else
+            fprintf (fp, "null");
+         return;
       }
-      string (xml_attribute_name (a), 1, 0);
-      fputc (':', fp);
-      string (xml_attribute_content (a), 0, a->json_unquoted);
-   }
-   q = NULL;
-   while ((q = xml_element_next (e, q)))
-   {
-      const char *n = xml_element_name (q);
-      if (xml_element_next_by_name (e, NULL, n) != q)
-         continue;              // done already
-      if (*n)
+      xml_attribute_t a;
+      char sep = 0;
+      a = NULL;
+      while ((a = xml_attribute_next (e, a)))
       {
          if (sep)
             fputc (sep, fp);
@@ -1893,76 +4066,163 @@ xml_element_write_json (FILE * fp, xml_t e)
             fputc ('{', fp);
             sep = ',';
          }
-         string (n, 1, 0);
+         string (xml_attribute_name (a), 1, 0);
          fputc (':', fp);
+         string (xml_attribute_content (a), 0, a->json_unquoted);
       }
-      if (!q->json_single)
-         fputc ('[', fp);
-      xml_t z = NULL;
-      char sep2 = 0;
-      while ((z = xml_element_next_by_name (e, z, n)))
+      if (depth == stacka)
       {
-         if (sep2)
-            fputc (sep2, fp);
-         else
-            sep2 = ',';
-         xml_element_write_json (fp, z);
-         if (q->json_single)
-            break;
+         stacka = stacka * 2 + 16;
+         stack = realloc (stack, sizeof (*stack) * stacka);
+         if (!stack)
+            errx (1, "malloc at line %d", __LINE__);
+      }
+      stack[depth].e = e;
+      stack[depth].q = NULL;
+      stack[depth].z = NULL;
+      stack[depth].sep = sep;
+      stack[depth].sep2 = 0;
+      depth++;
+   }
+   value (e);
+   while (depth)
+   {                            // Open objects are on the stack rather than recursing
+      e = stack[depth - 1].e;
+      xml_t q = stack[depth - 1].q,
+        z = NULL;
+      if (q && !(q->json_single && stack[depth - 1].z))
+         z = xml_element_next_by_name_ns_id (e, stack[depth - 1].z, NULL, (xml_name_id_t) q->name);
+      if (!z)
+      {                         // Next name
+         if (q && !q->json_single)
+            fputc (']', fp);
+         while ((q = xml_element_next (e, q)) && xml_element_next_by_name_ns_id (e, NULL, NULL, (xml_name_id_t) q->name) != q);  // done already
+         if (!q)
+         {
+            if (stack[depth - 1].sep)
+               fputc ('}', fp);
+            depth--;
+            continue;
+         }
+         const char *n = xml_element_name (q);
+         if (*n)
+         {
+            if (stack[depth - 1].sep)
+               fputc (stack[depth - 1].sep, fp);
+            else
+            {
+               fputc ('{', fp);
+               stack[depth - 1].sep = ',';
+            }
+            string (n, 1, 0);
+            fputc (':', fp);
+         }
+         if (!q->json_single)
+            fputc ('[', fp);
+         stack[depth - 1].q = z = q;
+         stack[depth - 1].sep2 = 0;
       }
-      if (!q->json_single)
-         fputc (']', fp);
+      stack[depth - 1].z = z;
+      if (stack[depth - 1].sep2)
+         fputc (stack[depth - 1].sep2, fp);
+      else
+         stack[depth - 1].sep2 = ',';
+      value (z);
    }
-   if (sep)
-      fputc ('}', fp);
+   free (stack);
 }
 
 xml_t
 xml_element_compress (xml_t e)
 {                               // Reduce single text only sub objects to attributes of parent
-   xml_t q,
-     next;
-   q = NULL;
-   next = xml_element_next (e, q);
-   while (next)
-   {
-      q = next;
+   xml_t top = e;
+   for (; e; e = element_walk (top, e))
+   {                            // Children are done before walking in to them
+      xml_t q,
+        next;
+      q = NULL;
       next = xml_element_next (e, q);
-      if (xml_attribute_next (q, NULL))
-         continue;              // has attributes
-      if (xml_element_next (q, NULL))
-         continue;              // has sub elements
-      const char *v = xml_element_content (q);
-      const char *n = xml_element_name (q);
-      if (xml_attribute_by_name (e, n))
-         continue;              // parent has attribute the same
-      if (xml_element_next_by_name (e, NULL, n) != q)
-         continue;              // object already done
-      if (xml_element_next_by_name (e, q, n))
-         continue;              // more than one object
-      if (v)
-         xml_attribute_set (e, n, v);
-      xml_element_delete (q);
-   }
-   q = NULL;
-   while ((q = xml_element_next (e, q)))
-      xml_element_compress (q);
-   return e;
+      while (next)
+      {
+         q = next;
+         next = xml_element_next (e, q);
+         if (xml_attribute_next (q, NULL))
+            continue;           // has attributes
+         if (xml_element_next (q, NULL))
+            continue;           // has sub elements
+         const char *v = xml_element_content (q);
+         const char *n = xml_element_name (q);
+         if (xml_attribute_by_name (e, n))
+            continue;           // parent has attribute the same
+         if (xml_element_next_by_name (e, NULL, n) != q)
+            continue;           // object already done
+         if (xml_element_next_by_name (e, q, n))
+            continue;           // more than one object
+         if (v)
+            xml_attribute_set (e, n, v);
+         xml_element_delete (q);
+      }
+   }
+   return top;
 }
 
 #ifdef	EXPAT
 // Parser
+static xml_namespacelist_t *
+parse_prefix (xml_parser_t p, int l, const char *tag)
+{                               // Hash chain for prefix, l=0 for default name space
+   return &p->prefix[xml_hash (l, tag) & (XML_PREFIX_HASH - 1)];
+}
+
+static xml_namespace_t
+parse_prefix_find (xml_parser_t p, int l, const char *tag)
+{                               // In scope name space for prefix
+   xml_namespacelist_t n;
+   for (n = *parse_prefix (p, l, tag); n; n = n->hash)
+      if ((!l && !n->tag) || (l && n->tag && !strncmp (n->tag, tag, l) && !n->tag[l]))
+         return n->namespace;
+   return NULL;
+}
+
+static void
+parse_prefix_push (xml_parser_t p, xml_namespacestack_t stack, xml_namespacelist_t ns)
+{                               // Bring prefix in to scope for this element
+   xml_namespacelist_t *h = parse_prefix (p, ns->tag ? strlen (ns->tag) : 0, ns->tag);
+   ns->hash = *h;
+   *h = ns;
+   ns->next = stack->ns;
+   stack->ns = ns;
+}
+
+static void
+parse_prefix_pop (xml_parser_t p)
+{                               // Take the prefixes of the innermost name space stack entry out of scope
+   xml_namespacestack_t s = p->namespacestack;
+   p->namespacestack = s->prev;
+   xml_namespacelist_t ns = s->ns;
+   xml_free (s);
+   while (ns)
+   {                            // Most recent first, so always the head of its chain
+      xml_namespacelist_t next = ns->next;
+      *parse_prefix (p, ns->tag ? strlen (ns->tag) : 0, ns->tag) = ns->hash;
+      // not free ns->namespace as copy of global
+      xml_free (ns->tag);
+      xml_free (ns);
+      ns = next;
+   }
+}
+
 static void
 parse_element_start (void *ud, const XML_Char * name, const XML_Char ** attr)
 {
-   xml_parser_t *p = ud;
+   xml_parser_t p = ud;
 #ifdef	PARSEDEBUG
    fprintf (stderr, "Start %s%s\n", name, p->here ? "" : " root");
 #endif
    if (!p->tree && p->callback)
-      p->tree = xml_tree_new (NULL)->tree;
+      p->tree = tree_new (NULL, p->arena)->tree;
    xml_root_t t = p->tree;
-   xml_t e = xml_alloc (sizeof (*e));
+   xml_t e = xml_alloc_t (t, sizeof (*e));
    e->tree = t;
    e->line = (int) XML_GetCurrentLineNumber (p->parser) + p->line_offset;
    e->filename = p->current_file;
@@ -1979,26 +4239,18 @@ parse_element_start (void *ud, const XML_Char * name, const XML_Char ** attr)
                   foundxml = 1;
                // global list
                xml_namespace_t namespace = 0;
-               xml_namespacelist_t ns;
-               for (ns = p->tree->namespacelist; ns && strcmp (ns->namespace->uri, a[1]); ns = ns->next);
+               xml_namespacelist_t ns = namespace_find (p->tree, strlen ((char *) a[1]), (char *) a[1]);
                if (ns)
                   namespace = ns->namespace;
                else
                {                // new namespace
-                  ns = xml_alloc (sizeof (*ns));
-                  ns->namespace = xml_alloc (sizeof (*ns->namespace) + strlen ((char *) a[1]) + 1);
-                  strcpy (ns->namespace->uri, (char *) a[1]);
+                  ns = namespace_add (p->tree, strlen ((char *) a[1]), (char *) a[1]);
                   namespace = ns->namespace;
                   if ((*a)[5] == ':' && !ns->tag)
                   {
-                     ns->tag = xml_dup ((char *) (*a) + 6);
+                     ns->tag = name_intern (p->tree, strlen ((*a) + 6), (*a) + 6);
                      namespace->fixed = 1;
                   }
-                  if (p->tree->namespacelist)
-                     p->tree->namespacelist_end->next = ns;
-                  else
-                     p->tree->namespacelist = ns;
-                  p->tree->namespacelist_end = ns;
                }
                // local namespace stack
                if (!stack)
@@ -2010,16 +4262,14 @@ parse_element_start (void *ud, const XML_Char * name, const XML_Char ** attr)
                if ((*a)[5] && !ns->tag)
                   ns->tag = xml_dup ((char *) (*a) + 6);
                ns->namespace = namespace;
-               ns->next = stack->ns;
-               stack->ns = ns;
+               parse_prefix_push (p, stack, ns);
             }
             a += 2;
          }
       if (!p->here && !foundxml)
       {                         // default xml namespace
-         xml_namespacelist_t ns;
-         for (ns = p->tree->namespacelist; ns && strcmp (ns->namespace->uri, "http://www.w3.org/XML/1998/namespace");
-              ns = ns->next);
+         const char *xmlns = "http://www.w3.org/XML/1998/namespace";
+         xml_namespacelist_t ns = namespace_find (p->tree, strlen (xmlns), xmlns);
          if (ns)
          {
             xml_namespace_t namespace = ns->namespace;
@@ -2031,8 +4281,7 @@ parse_element_start (void *ud, const XML_Char * name, const XML_Char ** attr)
             ns = xml_alloc (sizeof (*ns));
             ns->tag = xml_dup ("xml");
             ns->namespace = namespace;
-            ns->next = stack->ns;
-            stack->ns = ns;
+            parse_prefix_push (p, stack, ns);
          }
       }
       if (stack)
@@ -2047,27 +4296,16 @@ parse_element_start (void *ud, const XML_Char * name, const XML_Char ** attr)
       int l = 0;
       if (*c)
          l = (int) (c - name);
-      xml_namespacestack_t s = p->namespacestack;
-      while (s && !e->namespace)
-      {
-         xml_namespacelist_t n = s->ns;
-         while (n && !e->namespace)
-         {
-            if ((!l && !n->tag) || (l && n->tag && !strncmp (n->tag, name, l) && !n->tag[l]))
-               e->namespace = n->namespace;
-            n = n->next;
-         }
-         s = s->prev;
-      }
+      e->namespace = parse_prefix_find (p, l, name);
       if (*c && !e->namespace)
          errx (1, "Bad namespace on %s", name);
       if (l)
          name += l + 1;
    }
-   e->name = xml_dup ((char *) name);
+   e->name = name_intern (t, strlen (name), name);
    while (*attr)
    {                            // Attributes
-      xml_attribute_t a = xml_alloc (sizeof (*a));
+      xml_attribute_t a = xml_alloc_t (t, sizeof (*a));
       a->parent = e;
       a->namespace = 0;
       name = (*attr);
@@ -2079,26 +4317,15 @@ parse_element_start (void *ud, const XML_Char * name, const XML_Char ** attr)
             int l = 0;
             if (*c)
                l = (int) (c - name);
-            xml_namespacestack_t s = p->namespacestack;
-            while (s && !a->namespace)
-            {
-               xml_namespacelist_t n = s->ns;
-               while (n && !a->namespace)
-               {
-                  if ((!l && !n->tag) || (n->tag && l && !strncmp (n->tag, name, l) && !n->tag[l]))
-                     a->namespace = n->namespace;
-                  n = n->next;
-               }
-               s = s->prev;
-            }
+            a->namespace = parse_prefix_find (p, l, name);
             if (l)
                name += l + 1;
             if (!a->namespace)
                errx (1, "Bad name space on %s in %s", (*attr), e->name);
          }
       }
-      a->name = xml_dup ((char *) name);
-      a->content = xml_dup ((char *) attr[1]);
+      a->name = name_intern (t, strlen (name), name);
+      a->content = xml_dup_t (t, strlen (attr[1]), attr[1]);
       if (e->first_attribute)
          e->last_attribute->next = a;
       else
@@ -2116,15 +4343,28 @@ parse_element_start (void *ud, const XML_Char * name, const XML_Char ** attr)
       e->prev = p->here->last_child;
       p->here->last_child = e;
       e->parent = p->here;
+      if (p->here->indexed)
+         children_add (p->here, e, 1);
    } else
       t->root = e;              // root element
    p->here = e;
+   if (p->depth == p->contenta)
+   {
+      p->contenta = p->contenta * 2 + 16;
+      p->content = realloc (p->content, sizeof (*p->content) * p->contenta);
+      if (!p->content)
+         errx (1, "malloc at line %d", __LINE__);
+      memset (p->content + p->depth, 0, sizeof (*p->content) * (p->contenta - p->depth));
+   }
+   p->content[p->depth++].len = 0;
+   if (xml_depth_max && p->depth - (p->callback ? 1 : 0) > xml_depth_max)
+      XML_StopParser (p->parser, XML_FALSE);    // Nested too deep, fails as aborted (not counting wrapper when fed in parts)
 }
 
 static void
 parse_element_end (void *ud, const XML_Char * name)
 {
-   xml_parser_t *p = ud;
+   xml_parser_t p = ud;
 #ifdef	PARSEDEBUG
    fprintf (stderr, "End %s%s\n", name, p->here ? "" : " root");
 #endif
@@ -2134,38 +4374,19 @@ parse_element_end (void *ud, const XML_Char * name)
       name = q + 1;
    if (!p->here || strcmp (p->here->name, name))
       errx (1, "Invalid close tag %s", name);
-   if (p->here->first_child)
-   {
-      char *c = p->here->content;
-      if (c)
-      {
-         while (*c && isspace (*c))
-            c++;
-         if (!*c)
-         {                      // only whitespace, and child entries, no content
-            xml_free (p->here->content);
-            p->here->content = 0;
-         }
-      }
+   p->depth--;
+   struct xml_build_s *c = p->content + p->depth;
+   if (c->len)
+   {                            // Finished building, unless only whitespace between child elements
+      size_t i = 0;
+      if (p->here->first_child)
+         while (i < c->len && isspace (c->text[i]))
+            i++;
+      if (i < c->len)
+         p->here->content = xml_dup_t (p->tree, c->len, c->text);
    }
    if (p->namespacestack && p->namespacestack->base == p->here)
-   {
-      xml_namespacestack_t s = p->namespacestack;
-      p->namespacestack = s->prev;
-      xml_namespacelist_t ns = s->ns;
-      xml_free (s);
-      while (ns)
-      {
-         xml_namespacelist_t next = ns->next;
-         xml_namespacelist_t m = p->tree->namespacelist;
-         while (m && m->namespace != ns->namespace)
-            m = m->next;
-         // not free ns->namespace as copy of global
-         xml_free (ns->tag);
-         xml_free (ns);
-         ns = next;
-      }
-   }
+      parse_prefix_pop (p);
    p->here = p->here->parent;
    if (p->callback && !p->here && p->tree)
    {
@@ -2178,7 +4399,7 @@ parse_element_end (void *ud, const XML_Char * name)
 static void
 parse_character_data (void *ud, const XML_Char * s, int len)
 {
-   xml_parser_t *p = ud;
+   xml_parser_t p = ud;
 #ifdef	PARSEDEBUG
    fprintf (stderr, "Character data %d\n", len);
 #endif
@@ -2199,29 +4420,26 @@ parse_character_data (void *ud, const XML_Char * s, int len)
       if (i == len)
          return;                // whitespace between child entries
    }
-   if (p->here->content)
+   struct xml_build_s *c = p->content + p->depth - 1;   // Content built with length known, growing geometrically
+   if (c->len + len > c->alloc)
    {
-      int l = strlen (p->here->content);
-      p->here->content = realloc (p->here->content, l + len + 1);
-      if (!p->here->content)
+      c->alloc = (c->len + len) * 2;
+      c->text = realloc (c->text, c->alloc);
+      if (!c->text)
          errx (1, "Malloc content");
-      memmove (p->here->content + l, s, len);
-      p->here->content[l + len] = 0;    // realloc used so not already null
-   } else
-   {
-      p->here->content = xml_alloc (len + 1);
-      memmove (p->here->content, s, len);
    }
+   memmove (c->text + c->len, s, len);
+   c->len += len;
 }
 
 static void
 parse_pi (void *ud, const XML_Char * target, const XML_Char * data)
 {
-   xml_parser_t *p = ud;
-   xml_pi_t pi = xml_alloc (sizeof (*pi));
+   xml_parser_t p = ud;
+   xml_pi_t pi = xml_alloc_t (p->tree, sizeof (*pi));
    pi->tree = p->tree;
-   pi->name = xml_dup ((char *) target);
-   pi->content = xml_dup ((char *) data);
+   pi->name = xml_dup_t (p->tree, strlen (target), target);
+   pi->content = xml_dup_t (p->tree, strlen (data), data);
    if (p->tree->first_pi)
       p->tree->last_pi->next = pi;
    else
@@ -2429,172 +4647,755 @@ xml_tree_parse_json (const char *json, const char *rootname)
 }
 
 #ifdef	EXPAT
+static void
+parse_handlers (xml_parser_t p)
+{                               // Set up EXPAT parser to call us
+   XML_SetUserData (p->parser, p);
+   XML_SetElementHandler (p->parser, parse_element_start, parse_element_end);
+   XML_SetCharacterDataHandler (p->parser, parse_character_data);
+   XML_SetProcessingInstructionHandler (p->parser, parse_pi);
+}
+
+static void
+parse_start (xml_parser_t p)
+{                               // Start a new document, reusing the EXPAT parser and working storage if we have them
+   while (p->namespacestack)
+      parse_prefix_pop (p);     // Left by a failed parse
+   if (p->parser)
+      XML_ParserReset (p->parser, 0);
+   else
+      p->parser = XML_ParserCreate (0);
+   parse_handlers (p);
+   p->tree = tree_new (NULL, p->arena)->tree;
+   p->here = NULL;
+   p->current_file = NULL;
+   p->line_offset = 0;
+   p->depth = 0;
+}
+
+static void
+parse_end (xml_parser_t p)
+{                               // Free EXPAT parser and working storage
+   while (p->namespacestack)
+      parse_prefix_pop (p);
+   if (p->parser)
+      XML_ParserFree (p->parser);
+   p->parser = NULL;
+   while (p->contenta)
+      free (p->content[--p->contenta].text);
+   free (p->content);
+   p->content = NULL;
+}
+
+static xml_t
+parse_string (xml_parser_t p, const char *xml)
+{                               // parse an in-memory string, null terminated
+   parse_start (p);
+   if (!XML_Parse (p->parser, xml, strlen (xml), 1))
+   {
+      //warnx ("Parse failed at %d:%d %s", (int) XML_GetCurrentLineNumber (p->parser) + p->line_offset, (int) XML_GetCurrentColumnNumber (p->parser), XML_ErrorString (XML_GetErrorCode (p->parser)));
+      xml_tree_delete (p->tree->root);
+      p->tree = NULL;
+   }
+   if (!p->tree)
+      return NULL;
+   return p->tree->root;
+}
+
 xml_t
 xml_tree_parse (const char *xml)
 {                               // parse an in-memory string, null terminated
-   xml_parser_t parser = {
+   struct xml_parser_s parser = {
    };
-   parser.tree = xml_tree_new (NULL)->tree;
-   XML_Parser xml_parser = XML_ParserCreate (0);
-   parser.parser = xml_parser;
-   XML_SetUserData (xml_parser, &parser);
-   XML_SetElementHandler (xml_parser, parse_element_start, parse_element_end);
-   XML_SetCharacterDataHandler (xml_parser, parse_character_data);
-   XML_SetProcessingInstructionHandler (xml_parser, parse_pi);
-   if (!XML_Parse (xml_parser, xml, strlen (xml), 1))
-   {
-      //warnx ("Parse failed at %d:%d %s", (int) XML_GetCurrentLineNumber (xml_parser) + parser.line_offset, (int) XML_GetCurrentColumnNumber (xml_parser), XML_ErrorString (XML_GetErrorCode (xml_parser)));
-      xml_tree_delete (parser.tree->root);
-      parser.tree = NULL;
-   }
-   XML_ParserFree (xml_parser);
-   if (!parser.tree)
+   xml_t t = parse_string (&parser, xml);
+   parse_end (&parser);
+   return t;
+}
+#else
+xml_t
+xml_tree_parse (const char *xml)
+{                               // parse an in-memory string, null terminated
+   void er (const char *filename, int line, int character, const char *error, const unsigned char *posn)
+   {
+      warnx ("XML parse error in %s line %d:%d (%s) %s", filename ? : "stdin", line, character, error, posn);
+   }
+   return xml_parse (NULL, (const unsigned char *) xml, er, 0, NULL);
+}
+#endif
+
+xml_t
+xml_tree_parse_insitu (char *xml, size_t len)
+{                               // parse a malloced buffer, which the tree then owns
+   if (!xml)
+      return NULL;
+   xml = realloc (xml, len + 1);
+   if (!xml)
+      errx (1, "malloc at line %d", __LINE__);
+   xml[len] = 0;
+#ifdef	EXPAT
+   xml_t t = xml_tree_parse (xml);
+   free (xml);
+   return t;
+#else
+   void er (const char *filename, int line, int character, const char *error, const unsigned char *posn)
+   {
+      warnx ("XML parse error in %s line %d:%d (%s) %s", filename ? : "stdin", line, character, error, posn);
+   }
+   return xml_parse (NULL, (const unsigned char *) xml, er, 1, NULL);
+#endif
+}
+
+xml_t
+xml_tree_parse_select (const char *xml, const char **paths)
+{                               // parse an in-memory string, null terminated, only keeping elements on the paths
+#ifdef	EXPAT
+   paths = paths;
+   return xml_tree_parse (xml);
+#else
+   if (!paths)
+      return xml_tree_parse (xml);
+   void er (const char *filename, int line, int character, const char *error, const unsigned char *posn)
+   {
+      warnx ("XML parse error in %s line %d:%d (%s) %s", filename ? : "stdin", line, character, error, posn);
+   }
+   struct xml_select_s *s = select_new (paths);
+   xml_t t = xml_parse (NULL, (const unsigned char *) xml, er, 0, s);
+   select_free (s);
+   return t;
+#endif
+}
+
+#ifdef EXPAT
+static xml_t
+parse_file (xml_parser_t p, FILE * fp, const char *file)
+{                               // parse a file stream
+   if (!fp)
+      errx (1, "Bad FP");
+   parse_start (p);
+   p->current_file = file ? name_intern (p->tree, strlen (file), file) : NULL;
+   XML_Parser xml_parser = p->parser;
+#ifdef	CPP
+   // Line by line, to handle cpp line directives
+   int nextline = 1;            // This is what expat thinks the next line number is  
+   char *buf = NULL;
+   size_t bufspace = 0;
+   ssize_t len = 0;
+   while ((len = getline (&buf, &bufspace, fp)) > 0)
+   {
+      if (len > 2 && buf[0] == '#' && buf[1] == ' ')    // cpp line directive
+      {
+         char *s,
+          *q;
+         int n = strtol (buf + 2, &s, 10);
+         if (s != buf + 2)
+         {
+            while (isspace (*s))
+               s++;
+            if (*s == '"')
+            {
+               q = strrchr (s + 1, '"');
+               if (q)
+                  p->current_file = name_intern (p->tree, q - s - 1, s + 1);
+            }
+            p->line_offset = n - nextline;
+            continue;
+         }
+      }
+      if (nextline == 1 && len == 1 && *buf == '\n')
+      {
+         // ignore initial blank lines
+         p->line_offset++;
+         continue;
+      }
+      if (!XML_Parse (xml_parser, buf, len, 0))
+      {
+         const char *s1 = p->current_file ? " in " : "";
+         const char *s2 = p->current_file ? p->current_file : "";
+         warnx ("Parse failed at %d:%d%s%s %s", (int) XML_GetCurrentLineNumber (xml_parser) + p->line_offset,
+                (int) XML_GetCurrentColumnNumber (xml_parser), s1, s2, XML_ErrorString (XML_GetErrorCode (xml_parser)));
+         xml_tree_delete (p->tree->root);
+         p->tree = NULL;
+         break;
+      }
+      nextline++;
+   }
+   if (buf)
+      free (buf);
+#else
+   // Blocks read straight in to expat's buffer
+   int c;
+   while ((c = getc (fp)) == '\n')
+      p->line_offset++;     // ignore initial blank lines
+   if (c != EOF)
+      ungetc (c, fp);
+   while (1)
+   {
+      void *buf = XML_GetBuffer (xml_parser, 65536);
+      if (!buf)
+         errx (1, "malloc at line %d", __LINE__);
+      size_t len = fread (buf, 1, 65536, fp);
+      if (!len)
+         break;
+      if (!XML_ParseBuffer (xml_parser, len, 0))
+      {
+         const char *s1 = p->current_file ? " in " : "";
+         const char *s2 = p->current_file ? p->current_file : "";
+         warnx ("Parse failed at %d:%d%s%s %s", (int) XML_GetCurrentLineNumber (xml_parser) + p->line_offset,
+                (int) XML_GetCurrentColumnNumber (xml_parser), s1, s2, XML_ErrorString (XML_GetErrorCode (xml_parser)));
+         xml_tree_delete (p->tree->root);
+         p->tree = NULL;
+         break;
+      }
+   }
+#endif
+   if (p->tree && !feof (fp))
+   {
+      warnx ("Parse failed reading");
+      xml_tree_delete (p->tree->root);
+      p->tree = NULL;
+   }
+   if (p->tree && !XML_Parse (xml_parser, 0, 0, 1))
+   {
+      xml_tree_delete (p->tree->root);
+      p->tree = NULL;
+   }
+   if (!p->tree)
       return NULL;
-   return parser.tree->root;
+   return p->tree->root;
+}
+
+static xml_t
+xml_tree_read_f (FILE * fp, const char *file)
+{                               // parse a file stream
+   struct xml_parser_s parser = {
+      0
+   };
+   xml_t t = parse_file (&parser, fp, file);
+   parse_end (&parser);
+   return t;
+}
+
+struct xml_parse_ctx_s
+{                               // Reusable parser, EXPAT parser and working storage kept between documents
+   struct xml_parser_s p;
+};
+
+xml_parse_ctx_t
+xml_parse_ctx_new (void)
+{
+   return xml_alloc (sizeof (struct xml_parse_ctx_s));
+}
+
+xml_t
+xml_parse_ctx_parse (xml_parse_ctx_t c, const char *xml)
+{                               // parse an in-memory string, null terminated
+   return parse_string (&c->p, xml);
+}
+
+xml_t
+xml_parse_ctx_read (xml_parse_ctx_t c, FILE * fp)
+{                               // parse a file stream
+   return parse_file (&c->p, fp, NULL);
+}
+
+void
+xml_parse_ctx_arena (xml_parse_ctx_t c, int arena)
+{                               // Allocate later trees in an arena, or not
+   c->p.arena = (arena ? 1 : 0);
+}
+
+void
+xml_parse_ctx_reset (xml_parse_ctx_t c)
+{                               // Free working storage, context can still be used
+   parse_end (&c->p);
+}
+
+void
+xml_parse_ctx_free (xml_parse_ctx_t c)
+{
+   if (!c)
+      return;
+   parse_end (&c->p);
+   free (c);
+}
+
+xml_parser_t
+xml_parser_new (const char *filename, xml_callback_t * cb)
+{                               // Start parsing data that is to be fed in parts
+   xml_parser_t p = xml_alloc (sizeof (*p));
+   p->callback = cb;
+   p->parser = XML_ParserCreate (0);
+   parse_handlers (p);
+   if (cb)
+   {
+      XML_Parse (p->parser, "<xml>", 5, 0);     // wrap multiple instances - messy
+      xml_tree_delete (p->tree->root);
+      p->tree = NULL;
+      p->here = NULL;
+   } else
+   {
+      p->tree = xml_tree_new (NULL)->tree;
+      p->current_file = filename ? name_intern (p->tree, strlen (filename), filename) : NULL;
+   }
+   p->start = 1;
+   return p;
+}
+
+int
+xml_parser_feed (xml_parser_t p, const void *data, size_t len)
+{                               // Parse more data
+   if (!p->parser)
+      return -1;                // Already failed
+   const char *ptr = data;
+   if (p->start && p->callback && len > 2 && *ptr == '<' && ptr[1] == '?')
+   {                            // Lets hope whole declaration in one block - this is a bodge
+      while (len-- && *ptr++ != '>');
+   }
+   p->start = 0;
+   if (!XML_Parse (p->parser, ptr, len, 0))
+   {
+      const char *s1 = p->current_file ? " in " : "";
+      const char *s2 = p->current_file ? p->current_file : "";
+      warnx ("Parse failed at %d:%d%s%s %s", (int) XML_GetCurrentLineNumber (p->parser) + p->line_offset,
+             (int) XML_GetCurrentColumnNumber (p->parser), s1, s2, XML_ErrorString (XML_GetErrorCode (p->parser)));
+      if (p->tree)
+         xml_tree_delete (p->tree->root);
+      p->tree = NULL;
+      XML_ParserFree (p->parser);
+      p->parser = NULL;
+      return -1;
+   }
+   return 0;
+}
+
+xml_t
+xml_parser_finish (xml_parser_t p)
+{                               // End of data, free parser and return tree
+   xml_t t = NULL;
+   if (p->parser)
+   {
+      if (p->callback)
+      {                         // Wrapped, so not expecting a proper end
+         if (p->tree)
+         {
+            xml_tree_delete (p->tree->root);
+            warnx ("Parse incomplete");
+         }
+      } else if (!XML_Parse (p->parser, 0, 0, 1))
+      {
+         warnx ("Parse failed at %d:%d %s", (int) XML_GetCurrentLineNumber (p->parser) + p->line_offset,
+                (int) XML_GetCurrentColumnNumber (p->parser), XML_ErrorString (XML_GetErrorCode (p->parser)));
+         xml_tree_delete (p->tree->root);
+      } else
+         t = p->tree->root;
+      XML_ParserFree (p->parser);
+   }
+   while (p->contenta)
+      free (p->content[--p->contenta].text);
+   free (p->content);
+   xml_free (p);
+   return t;
+}
+#else
+static void
+read_error (const char *filename, int line, int character, const char *error, const unsigned char *posn)
+{                               // Report parse error for a file, showing context
+   fprintf (stderr, "XML parse error in %s line %d:%d (%s)", filename ? : "stdin", line, character, error);
+   if (posn)
+   {
+      fprintf (stderr, " at: ");
+      if (character > 101)
+      {
+         character = 101;
+         fprintf (stderr, "…");
+      }
+      if (character)
+         character--;
+      if (character)
+         fprintf (stderr, "%.*s", character, posn - character);
+      fprintf (stderr, "◆");
+      int c = 0;
+      while (posn[c] >= ' ')
+         c++;
+      if (c > 100)
+         c = 100;
+      fprintf (stderr, "%.*s", c, posn);
+      if (posn[c] >= ' ')
+         fprintf (stderr, "…");
+   }
+   fprintf (stderr, "\n");
+}
+
+xml_parser_t
+xml_parser_new (const char *filename, xml_callback_t * cb)
+{                               // Start parsing data that is to be fed in parts
+   xml_parser_t x = malloc (sizeof (*x));
+   if (!x)
+      errx (1, "malloc at line %d", __LINE__);
+   parser_init (x, filename ? xml_dup (filename) : NULL, &read_error, cb);
+   return x;
+}
+
+static int
+parser_add (xml_parser_t x, const void *data, size_t len)
+{                               // Add data, returns non zero if there is more we can parse
+   if (x->used > 128)
+   {                            // Drop what has been parsed, keeping a little for error context
+      size_t drop = x->used - 128;
+      memmove (x->data, x->data + drop, x->datal - drop);
+      x->datal -= drop;
+      x->used -= drop;
+      x->posn -= drop;
+   }
+   if (x->datal + len + 1 > x->dataa)
+   {
+      x->dataa = (x->datal + len + 1) * 2;
+      x->data = realloc (x->data, x->dataa);
+      if (!x->data)
+         errx (1, "malloc at line %d", __LINE__);
+   }
+   memcpy (x->data + x->datal, data, len);
+   const unsigned char *gt = memrchr (x->data + x->datal, '>', len);
+   x->datal += len;
+   x->data[x->datal] = 0;
+   if (!gt)
+      return 0;
+   x->cut = gt + 1 - x->data;
+   return 1;
+}
+
+int
+xml_parser_feed (xml_parser_t x, const void *data, size_t len)
+{                               // Add data, and parse up to the last > we have
+   if (x->state == XML_PARSE_ERROR)
+      return -1;
+   if (!len)
+      return 0;
+   if (parser_add (x, data, len))
+      parser_run (x, 0);
+   return x->state == XML_PARSE_ERROR;
+}
+
+xml_t
+xml_parser_finish (xml_parser_t x)
+{                               // Parse what is left and free parser, returning tree
+   xml_t t = NULL;
+   if (x->data)
+   {
+      parser_run (x, 1);
+      t = parser_end (x);
+   } else if ((t = parser_end (x)))
+      t = xml_tree_delete (t);  // No data, silently ignore
+   xml_free ((char *) x->filename);
+   free (x);
+   return t;
+}
+
+static xml_t
+xml_tree_read_f (FILE * i, const char *file)
+{
+   xml_parser_t x = xml_parser_new (file, NULL);
+   char buf[65536];
+   size_t l;
+   while ((l = fread (buf, 1, sizeof (buf), i)) > 0 && !xml_parser_feed (x, buf, l));
+   return xml_parser_finish (x);        // Empty file silently ignored
+}
+
+struct xml_parse_ctx_s
+{                               // Reusable parser, working storage kept between documents
+   struct xml_parser_s x;
+   unsigned char *data;         // Input buffer for reading files
+   size_t dataa;
+};
+
+xml_parse_ctx_t
+xml_parse_ctx_new (void)
+{
+   xml_parse_ctx_t c = xml_alloc (sizeof (*c));
+   c->x.fail = &read_error;
+   return c;
 }
-#else
+
 xml_t
-xml_tree_parse (const char *xml)
+xml_parse_ctx_parse (xml_parse_ctx_t c, const char *xml)
 {                               // parse an in-memory string, null terminated
-   void er (const char *filename, int line, int character, const char *error, const unsigned char *posn)
+   if (!xml)
    {
-      warnx ("XML parse error in %s line %d:%d (%s) %s", filename ? : "stdin", line, character, error, posn);
+      c->x.fail (NULL, 0, 0, "NULL file", NULL);
+      return NULL;
    }
-   return xml_parse (NULL, (const unsigned char *) xml, er);
+   parser_reuse (&c->x);
+   c->x.data = (unsigned char *) xml;
+   parser_run (&c->x, 1);
+   c->x.data = NULL;
+   return parser_tree (&c->x);
 }
-#endif
 
-#ifdef EXPAT
-static xml_t
-xml_tree_read_f (FILE * fp, const char *file)
+xml_t
+xml_parse_ctx_read (xml_parse_ctx_t c, FILE * fp)
 {                               // parse a file stream
-   xml_parser_t parser = {
-      0
-   };
-   parser.tree = xml_tree_new (NULL)->tree;
-   if (!fp)
-      errx (1, "Bad FP");
-   parser.current_file = file ? savestring (file, strlen (file), parser.tree) : NULL;
-   XML_Parser xml_parser = XML_ParserCreate (0);
-   parser.parser = xml_parser;
-   XML_SetUserData (xml_parser, &parser);
-   XML_SetElementHandler (xml_parser, parse_element_start, parse_element_end);
-   XML_SetCharacterDataHandler (xml_parser, parse_character_data);
-   XML_SetProcessingInstructionHandler (xml_parser, parse_pi);
-   int nextline = 1;            // This is what expat thinks the next line number is  
-   char *buf = NULL;
-   size_t bufspace = 0;
-   ssize_t len = 0;
-   while ((len = getline (&buf, &bufspace, fp)) > 0)
+   xml_parser_t x = &c->x;
+   parser_reuse (x);
+   x->data = c->data;
+   x->dataa = c->dataa;
+   char buf[65536];
+   size_t l;
+   while ((l = fread (buf, 1, sizeof (buf), fp)) > 0 && !xml_parser_feed (x, buf, l));
+   if (x->datal)
+      parser_run (x, 1);
+   xml_t t = parser_tree (x);
+   if (!x->datal && t)
+      t = xml_tree_delete (t);  // Empty file silently ignored
+   c->data = x->data;
+   c->dataa = x->dataa;
+   x->data = NULL;
+   x->dataa = 0;
+   return t;
+}
+
+void
+xml_parse_ctx_arena (xml_parse_ctx_t c, int arena)
+{                               // Allocate later trees in an arena, or not
+   c->x.arena = (arena ? 1 : 0);
+}
+
+void
+xml_parse_ctx_reset (xml_parse_ctx_t c)
+{                               // Free working storage, context can still be used
+   unsigned char arena = c->x.arena;
+   parser_free (&c->x);
+   memset (&c->x, 0, sizeof (c->x));
+   c->x.fail = &read_error;
+   c->x.arena = arena;
+   free (c->data);
+   c->data = NULL;
+   c->dataa = 0;
+}
+
+void
+xml_parse_ctx_free (xml_parse_ctx_t c)
+{
+   if (!c)
+      return;
+   xml_parse_ctx_reset (c);
+   free (c);
+}
+
+struct xml_reader_s
+{                               // Pull reader
+   struct xml_parser_s x;
+   FILE *fp;
+   int event;                   // Last event returned
+   int depth;                   // Depth of last event
+   unsigned char more:1;        // Parser may have more events from data we have
+   unsigned char eof:1;         // All data read
+};
+
+xml_reader_t
+xml_reader_new (FILE * fp, const char *filename)
+{                               // Start pull reading a file
+   xml_reader_t r = malloc (sizeof (*r));
+   if (!r)
+      errx (1, "malloc at line %d", __LINE__);
+   parser_init (&r->x, filename ? xml_dup (filename) : NULL, &read_error, NULL);
+   r->x.pull = 1;
+   r->fp = fp;
+   r->event = 0;
+   r->depth = 0;
+   r->more = 0;
+   r->eof = 0;
+   return r;
+}
+
+int
+xml_reader_next (xml_reader_t r)
+{                               // Next event, 0 at end, -1 on error (reported)
+   xml_parser_t x = &r->x;
+   if (r->event < 0)
+      return r->event;
+   // Finish with last event, so only the open elements are held
+   if (r->event == XML_READER_START && x->empty)
+   {                            // EmptyElemTag, the END is the same element
+      x->empty = 0;
+      return r->event = XML_READER_END;
+   }
+   if (r->event == XML_READER_END)
+      xml_element_delete (x->current);  // Root is left as empty root
+   else if (r->event == XML_READER_TEXT)
+      x->bufl = x->stack[x->depth - 1].base;
+   else if (r->event == XML_READER_PI)
+      xml_pi_delete (x->root->tree->last_pi);
+   x->current = NULL;
+   r->event = 0;
+   char buf[65536];
+   while (1)
    {
-#ifdef	CPP
-      if (len > 2 && buf[0] == '#' && buf[1] == ' ')    // cpp line directive
+      if ((r->more || r->eof) && x->data)
       {
-         char *p,
-          *q;
-         int n = strtol (buf + 2, &p, 10);
-         if (p != buf + 2)
+         parser_run (x, r->eof);
+         if (x->state == XML_PARSE_ERROR)
+            return r->event = -1;
+         if (x->event)
          {
-            while (isspace (*p))
-               p++;
-            if (*p == '"')
-            {
-               q = strrchr (p + 1, '"');
-               if (q)
-                  parser.current_file = savestring (p + 1, q - p - 1, parser.tree);
-            }
-            parser.line_offset = n - nextline;
-            continue;
+            r->depth = x->depth;
+            if (x->event == XML_READER_END || (x->event == XML_READER_START && x->empty))
+               r->depth++;      // Element no longer (or not) stacked
+            return r->event = x->event;
          }
+         r->more = 0;
       }
-#endif
-      if (nextline == 1 && len == 1 && *buf == '\n')
-      {
-         // ignore initial blank lines
-         parser.line_offset++;
-         continue;
-      }
-      if (!XML_Parse (xml_parser, buf, len, 0))
-      {
-         const char *s1 = parser.current_file ? " in " : "";
-         const char *s2 = parser.current_file ? parser.current_file : "";
-         warnx ("Parse failed at %d:%d%s%s %s", (int) XML_GetCurrentLineNumber (xml_parser) + parser.line_offset,
-                (int) XML_GetCurrentColumnNumber (xml_parser), s1, s2, XML_ErrorString (XML_GetErrorCode (xml_parser)));
-         xml_tree_delete (parser.tree->root);
-         parser.tree = NULL;
-         break;
-      }
-      nextline++;
-   }
-   if (buf)
-      free (buf);
-   if (parser.tree && !feof (fp))
-   {
-      warnx ("Parse failed reading");
-      xml_tree_delete (parser.tree->root);
-      parser.tree = NULL;
-   }
-   if (parser.tree && !XML_Parse (xml_parser, 0, 0, 1))
-   {
-      xml_tree_delete (parser.tree->root);
-      parser.tree = NULL;
+      if (r->eof)
+         return 0;
+      size_t l = fread (buf, 1, sizeof (buf), r->fp);
+      if (l)
+         r->more = parser_add (x, buf, l);
+      else
+         r->eof = 1;
    }
-   XML_ParserFree (xml_parser);
-   if (!parser.tree)
+}
+
+xml_t
+xml_reader_element (xml_reader_t r)
+{                               // The element for START or END, or containing TEXT
+   return r->x.current;
+}
+
+const char *
+xml_reader_text (xml_reader_t r)
+{                               // The text for TEXT
+   xml_parser_t x = &r->x;
+   if (r->event != XML_READER_TEXT)
       return NULL;
-   return parser.tree->root;
+   x->buf[x->bufl] = 0;
+   return x->buf + x->stack[x->depth - 1].base;
 }
-#else
-static xml_t
-xml_tree_read_f (FILE * i, const char *file)
-{
-   char *xml = NULL;
-   size_t len = 0;
-   FILE *o = open_memstream (&xml, &len);
-   char buf[10240];
-   size_t l;
-   while ((l = fread (buf, 1, sizeof (buf), i)) > 0)
-      fwrite (buf, l, 1, o);
-   //fputc (0, o); // open_memstream maintains a null so this is not needed
-   fclose (o);
-   if (!len)
-   {                            // Empty file, silently ignore
-      free (xml);
+
+xml_pi_t
+xml_reader_pi (xml_reader_t r)
+{                               // The PI for PI
+   if (r->event != XML_READER_PI)
+      return NULL;
+   return r->x.root->tree->last_pi;
+}
+
+int
+xml_reader_depth (xml_reader_t r)
+{                               // Depth of element for START or END (root is 1), or containing TEXT or PI
+   return r->depth;
+}
+
+xml_t
+xml_reader_subtree (xml_reader_t r)
+{                               // At START, parse the rest of the element and return it as the root of its own tree
+   xml_parser_t x = &r->x;
+   if (r->event != XML_READER_START)
       return NULL;
+   xml_t e = x->current;
+   if (x->empty)
+      x->empty = 0;
+   else
+   {                            // Build the content and child elements as a normal parse
+      x->capture = x->depth;
+      if (xml_reader_next (r) != XML_READER_END)
+         return NULL;
    }
-   void er (const char *filename, int line, int character, const char *error, const unsigned char *posn)
-   {
-      fprintf (stderr, "XML parse error in %s line %d:%d (%s)", filename ? : "stdin", line, character, error);
-      if (posn)
+   r->event = 0;                // The END is not reported
+   x->current = NULL;
+   // Move to new tree
+   xml_root_t o = e->tree;
+   xml_t n = xml_tree_new (NULL);
+   xml_root_t t = n->tree;
+   children_drop (o, e);
+   attributes_drop (o, e);
+   if (o->index)
+      index_element (e, 0);
+#define m(x) n->x=e->x;e->x=NULL;
+   m (name);
+   m (content);
+   m (namespace);
+   m (first_child);
+   m (last_child);
+   m (first_attribute);
+   m (last_attribute);
+   m (filename);
+#undef m
+   n->line = e->line;
+   xml_t c;
+   for (c = n->first_child; c; c = c->next)
+      c->parent = n;
+   xml_attribute_t a;
+   for (a = n->first_attribute; a; a = a->next)
+      a->parent = n;
+   xml_element_delete (e);      // Now empty, left in place if root
+   for (c = n->first_child; c; c = element_walk (n, c))
+   {                            // Indexes and hashes are in the old tree, so drop them before the elements move
+      children_drop (o, c);
+      attributes_drop (o, c);
+   }
+   xml_namespacelist_t l;
+   for (l = o->namespacelist; l; l = l->next)
+      change_namespace (n, l->namespace,
+                        xml_namespace_l (n, l->tag ? strlen (l->tag) : 0, l->tag, strlen (l->namespace->uri), l->namespace->uri), t);
+   update_treerefs (n, t);
+   // PIs within the element
+   xml_pi_t p;
+   for (p = o->first_pi; p; p = p->next)
+      p->tree = t;
+   t->first_pi = o->first_pi;
+   t->last_pi = o->last_pi;
+   o->first_pi = o->last_pi = NULL;
+   return n;
+}
+
+void
+xml_reader_free (xml_reader_t r)
+{                               // Free reader, the file is not closed
+   xml_t t = parser_end (&r->x);
+   if (t)
+      xml_tree_delete (t);
+   xml_free ((char *) r->x.filename);
+   free (r);
+}
+
+int
+xml_tree_read_each (FILE * fp, int depth, xml_callback_t * cb)
+{                               // Call cb with each element at depth (root is 1) as root of its own tree, deleted after
+   xml_reader_t r = xml_reader_new (fp, NULL);
+   int count = 0,
+      e;
+   while ((e = xml_reader_next (r)) > 0)
+      if (e == XML_READER_START && xml_reader_depth (r) == depth)
       {
-         fprintf (stderr, " at: ");
-         if (character > 101)
-         {
-            character = 101;
-            fprintf (stderr, "…");
-         }
-         if (character)
-            character--;
-         if (character)
-            fprintf (stderr, "%.*s", character, posn - character);
-         fprintf (stderr, "◆");
-         int c = 0;
-         while (posn[c] >= ' ')
-            c++;
-         if (c > 100)
-            c = 100;
-         fprintf (stderr, "%.*s", c, posn);
-         if (posn[c] >= ' ')
-            fprintf (stderr, "…");
-      }
-      fprintf (stderr, "\n");
-   }
-   xml_t e = xml_parse (file, (const unsigned char *) xml, &er);
-   free (xml);
-   return e;
+         xml_t t = xml_reader_subtree (r);
+         if (!t)
+            break;              // Failed
+         cb (t);
+         xml_tree_delete (t);
+         count++;
+      }
+   if (e < 0 || r->x.state == XML_PARSE_ERROR)
+      count = -1;
+   xml_reader_free (r);
+   return count;
 }
 #endif
 
+static const char *
+map_file (int fd, size_t *lenp)
+{                               // Map a regular file read only, NULL if not possible
+   // The mapping is null terminated by the zero fill of the last page, so file size must not be a whole number of pages
+   // Pages are read as parsed, so a file truncated meanwhile gives SIGBUS rather than a short read (documented for xml_tree_read_file)
+   struct stat s;
+   if (fstat (fd, &s) || !S_ISREG (s.st_mode) || !s.st_size || !(s.st_size % sysconf (_SC_PAGESIZE)))
+      return NULL;
+   void *m = mmap (NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (m == MAP_FAILED)
+      return NULL;
+   madvise (m, s.st_size, MADV_SEQUENTIAL);
+   *lenp = s.st_size;
+   return m;
+}
+
 xml_t
 xml_tree_read_json (FILE * fp, const char *rootname)
 {
@@ -2640,7 +5441,15 @@ xml_tree_read_file_json (const char *filename)
       l++;
    else
       l = filename;
-   xml_t tree = xml_tree_read_json (fp, l);
+   xml_t tree;
+   size_t len;
+   const char *json = map_file (fileno (fp), &len);
+   if (json)
+   {                            // Parse direct from file
+      tree = xml_tree_parse_json (json, l);
+      munmap ((void *) json, len);
+   } else
+      tree = xml_tree_read_json (fp, l);
    fclose (fp);
    return tree;
 }
@@ -2651,11 +5460,385 @@ xml_tree_read_file (const char *filename)
    FILE *fp = fopen (filename, "r");
    if (!fp)
       return NULL;
-   xml_t tree = xml_tree_read_f (fp, filename);
+   xml_t tree;
+#ifdef	EXPAT
+   tree = xml_tree_read_f (fp, filename);       // Handles initial blank lines and (if CPP) line directives
+#else
+   size_t len;
+   const char *xml = map_file (fileno (fp), &len);
+   if (xml)
+   {                            // Parse direct from file
+      tree = xml_parse (filename, (const unsigned char *) xml, &read_error, 0, NULL);
+      munmap ((void *) xml, len);
+   } else
+      tree = xml_tree_read_f (fp, filename);
+#endif
    fclose (fp);
    return tree;
 }
 
+xml_t
+xml_tree_read_file_select (const char *filename, const char **paths)
+{                               // Parse a file by name, only keeping elements on the paths
+#ifndef	EXPAT
+   if (paths)
+   {
+      FILE *fp = fopen (filename, "r");
+      if (!fp)
+         return NULL;
+      size_t len;
+      char *mem = NULL;
+      const char *xml = map_file (fileno (fp), &len);
+      if (!xml)
+      {                         // Read it all
+         size_t a = 0;
+         len = 0;
+         while (!feof (fp) && !ferror (fp))
+         {
+            if (len + 65536 + 1 > a)
+            {
+               a = (len + 65536 + 1) * 2;
+               mem = realloc (mem, a);
+               if (!mem)
+                  errx (1, "malloc at line %d", __LINE__);
+            }
+            len += fread (mem + len, 1, 65536, fp);
+         }
+         mem[len] = 0;
+      }
+      struct xml_select_s *s = select_new (paths);
+      xml_t tree = xml_parse (filename, (const unsigned char *) (mem ? : xml), &read_error, 0, s);
+      select_free (s);
+      if (mem)
+         free (mem);
+      else
+         munmap ((void *) xml, len);
+      fclose (fp);
+      return tree;
+   }
+#else
+   paths = paths;
+#endif
+   return xml_tree_read_file (filename);
+}
+
+#ifndef	EXPAT
+struct xml_chunk_s
+{                               // Part of root content, starting at a child of root, parsed in parallel
+   size_t start,                // Offset in data
+     len;
+   xml_t root;                  // Stand in for root, holding the children and PIs, NULL if failed
+   char *text;                  // Text of root in this part
+   size_t textl;
+   int line,                    // Lines and characters parsed, for errors later
+     character;
+   size_t posn;                 // Last character parsed, offset in chunk
+   xml_namespace_t *map;        // Pairs of name spaces, this tree and main tree
+   int mapn;
+};
+
+struct xml_chunks_s
+{                               // Parallel parse
+   xml_parser_t x;              // Main parser, at start of root content
+   struct xml_chunk_s *chunk;
+   int n,
+     next;                      // Next chunk to process
+   unsigned char move:1;        // Moving in to main tree, else parsing
+};
+
+static void
+chunk_parse (xml_parser_t m, struct xml_chunk_s *c)
+{                               // Parse part of root content in to its own tree, as if in the root element
+   struct xml_parser_s x;
+   parser_init (&x, NULL, NULL, NULL);
+   int i;
+   for (i = 1; i < m->nssp; i++)
+   {                            // Name spaces in scope, without tags so they are not changed when moved to main tree
+      parser_ns (&x, m->nss[i].tagl, (unsigned char *) m->nsb + m->nss[i].tag, 0, NULL);
+      xml_namespace_t ns = m->nss[i].namespace;
+      if (ns)
+         x.nss[x.nssp - 1].namespace = xml_namespace_l (x.root, 0, NULL, strlen (ns->uri), ns->uri);
+   }
+   x.stack = xml_alloc (sizeof (*x.stack) * (x.stacka = 16));
+   x.stack->n = x.root;
+   x.stack->nssp = x.nssp;
+   x.depth = 1;
+   x.state = XML_PARSE_CONTENT;
+   x.data = m->data + c->start; // In place, the rest of the data follows so is null terminated
+   x.stop = c->len;
+   parser_run (&x, 1);
+   if (x.state != XML_PARSE_ERROR && (x.depth != 1 || x.used != c->len))
+   {                            // Not whole elements, let the serial parse report it
+      xml_tree_delete (x.root);
+      x.state = XML_PARSE_ERROR;
+   }
+   c->text = xml_dup_l (x.bufl, x.buf);
+   c->textl = x.bufl;
+   c->line = x.line;
+   c->character = x.character;
+   c->posn = x.posn;
+   c->root = parser_end (&x);
+}
+
+static xml_namespace_t
+chunk_ns (struct xml_chunk_s *c, xml_namespace_t ns)
+{                               // Main tree name space
+   int i;
+   for (i = 0; i < c->mapn; i++)
+      if (c->map[i * 2] == ns)
+         return c->map[i * 2 + 1];
+   return ns;
+}
+
+static xml_name_t
+chunk_name (xml_name_t n)
+{                               // Main tree name, interned in advance
+   if (!n || n == empty)
+      return n;
+   return name_entry (n)->other;
+}
+
+static void
+chunk_move (struct xml_chunk_s *c, xml_t e, xml_root_t t)
+{                               // Change element and all under it to be in main tree
+   xml_t top = e;
+   for (; e; e = element_walk (top, e))
+   {
+      children_drop (e->tree, e);       // Names change
+      attributes_drop (e->tree, e);
+      e->tree = t;
+      e->namespace = chunk_ns (c, e->namespace);
+      e->name = chunk_name (e->name);
+      xml_attribute_t a;
+      for (a = e->first_attribute; a; a = a->next)
+      {
+         a->namespace = chunk_ns (c, a->namespace);
+         a->name = chunk_name (a->name);
+      }
+   }
+}
+
+static void *
+chunk_thread (void *arg)
+{                               // Parse, or move in to main tree, chunks until none left
+   struct xml_chunks_s *s = arg;
+   xml_t root = s->x->root;
+   int i;
+   while ((i = __sync_fetch_and_add (&s->next, 1)) < s->n)
+   {
+      struct xml_chunk_s *c = s->chunk + i;
+      if (!s->move)
+         chunk_parse (s->x, c);
+      else
+      {
+         xml_t e;
+         for (e = c->root->first_child; e; e = e->next)
+         {
+            chunk_move (c, e, root->tree);
+            e->parent = root;
+         }
+         xml_pi_t p;
+         for (p = c->root->tree->first_pi; p; p = p->next)
+            p->tree = root->tree;
+      }
+   }
+   return NULL;
+}
+
+static void
+chunk_threads (struct xml_chunks_s *s, int threads)
+{                               // Run chunk_thread on threads, including this one
+   if (threads > s->n)
+      threads = s->n;
+   pthread_t *t = malloc (sizeof (*t) * threads);
+   if (!t)
+      errx (1, "malloc at line %d", __LINE__);
+   int n;
+   s->next = 0;
+   for (n = 0; n < threads - 1 && !pthread_create (&t[n], NULL, chunk_thread, s); n++);
+   chunk_thread (s);
+   while (n--)
+      pthread_join (t[n], NULL);
+   free (t);
+}
+
+static xml_t
+xml_parse_parallel (const char *filename, const unsigned char *xml, size_t len, int threads)
+{                               // Parse null terminated XML data, with parts of root content parsed on threads
+   // The result is the same as xml_parse, if anything does not look right we simply carry on with a serial parse
+   struct xml_parser_s x;
+   parser_init (&x, filename, &read_error, NULL);
+   x.data = (unsigned char *) xml;
+   x.pull = 1;
+   do
+      parser_run (&x, 1);       // Up to the root STag
+   while (x.event == XML_READER_PI);
+   x.pull = 0;
+   struct xml_chunks_s s;
+   memset (&s, 0, sizeof (s));
+   s.x = &x;
+   if (x.event == XML_READER_START && !x.empty)
+   {                            // Find children of root to split at, respecting CDATA, comments, PIs, and quotes
+      size_t target = (len - x.used) / threads / 4;
+      if (target < 65536)
+         target = 65536;
+      size_t start = x.used;
+      int depth = 1,
+         a = 0;
+      const unsigned char *p = xml + x.used;
+      while (p)
+      {
+         p = (const unsigned char *) strchr ((const char *) p, '<');
+         if (!p)
+            break;
+         if (p[1] == '/' && depth == 1)
+            break;              // Root ETag
+         if (p[1] != '/' && p[1] != '?' && p[1] != '!')
+         {                      // STag or EmptyElemTag
+            if (depth == 1 && p - xml - start >= target)
+            {                   // Start a new chunk here
+               if (s.n + 1 >= a)
+               {
+                  a = a * 2 + 16;
+                  s.chunk = realloc (s.chunk, sizeof (*s.chunk) * a);
+                  if (!s.chunk)
+                     errx (1, "malloc at line %d", __LINE__);
+               }
+               memset (s.chunk + s.n, 0, sizeof (*s.chunk));
+               s.chunk[s.n].start = start;
+               s.chunk[s.n++].len = p - xml - start;
+               start = p - xml;
+            }
+         }
+         p = xml_skip_markup (p, &depth);
+         if (p)
+            p++;
+      }
+      if (p && s.n)
+      {                         // Last chunk up to root ETag
+         memset (s.chunk + s.n, 0, sizeof (*s.chunk));
+         s.chunk[s.n].start = start;
+         s.chunk[s.n++].len = p - xml - start;
+      } else
+         s.n = 0;               // Not splitting
+   }
+   if (s.n)
+   {
+      // Make sure the scanner is picked before threads start
+      int lines;
+      const unsigned char *nl;
+      xml_scan ((const unsigned char *) "", 0, 0, 0, &lines, &nl);
+      chunk_threads (&s, threads);
+      int i;
+      for (i = 0; i < s.n && s.chunk[i].root; i++);
+      if (i == s.n)
+      {                         // All parsed, name spaces in order, as the serial parse would define them
+         for (i = 0; i < s.n; i++)
+         {
+            struct xml_chunk_s *c = s.chunk + i;
+            xml_namespacelist_t l;
+            for (l = c->root->tree->namespacelist; l; l = l->next)
+               c->mapn++;
+            c->map = malloc (sizeof (*c->map) * 2 * c->mapn);
+            if (!c->map)
+               errx (1, "malloc at line %d", __LINE__);
+            int n = 0;
+            for (l = c->root->tree->namespacelist; l; l = l->next)
+            {
+               c->map[n++] = l->namespace;
+               c->map[n++] =
+                  xml_namespace_l (x.root, l->tag ? strlen (l->tag) : 0, l->tag, strlen (l->namespace->uri), l->namespace->uri);
+            }
+            xml_root_t ct = c->root->tree;
+            for (n = 0; n < ct->internn; n++)
+            {
+               xml_intern_t i;
+               for (i = ct->intern[n]; i; i = i->next)
+                  i->other = name_intern (x.root->tree, i->len, i->name);
+            }
+         }
+         s.move = 1;
+         chunk_threads (&s, threads);
+         // Link in to main tree, and carry on from root ETag
+         xml_root_t t = x.root->tree;
+         for (i = 0; i < s.n; i++)
+         {
+            struct xml_chunk_s *c = s.chunk + i;
+            xml_t r = c->root;
+            if (r->first_child)
+            {
+               if (x.root->last_child)
+               {
+                  x.root->last_child->next = r->first_child;
+                  r->first_child->prev = x.root->last_child;
+               } else
+                  x.root->first_child = r->first_child;
+               x.root->last_child = r->last_child;
+               r->first_child = r->last_child = NULL;
+            }
+            if (r->tree->first_pi)
+            {
+               if (t->last_pi)
+               {
+                  t->last_pi->next = r->tree->first_pi;
+                  r->tree->first_pi->prev = t->last_pi;
+               } else
+                  t->first_pi = r->tree->first_pi;
+               t->last_pi = r->tree->last_pi;
+               r->tree->first_pi = r->tree->last_pi = NULL;
+            }
+            parser_addb (&x, c->textl, c->text);
+            x.line += c->line;
+            if (c->line)
+               x.character = c->character;
+            else
+               x.character += c->character;
+            x.posn = c->start + c->posn;
+            x.used = c->start + c->len;
+         }
+      }
+      for (i = 0; i < s.n; i++)
+      {
+         if (s.chunk[i].root)
+            xml_tree_delete (s.chunk[i].root);
+         xml_free (s.chunk[i].text);
+         free (s.chunk[i].map);
+      }
+   }
+   free (s.chunk);
+   parser_run (&x, 1);          // The rest, or all of it if not split
+   return parser_end (&x);
+}
+#endif
+
+xml_t
+xml_tree_read_file_parallel (const char *filename, int threads)
+{                               // Parse a file by name, with children of root parsed on threads (0 for one per CPU)
+#ifndef	EXPAT
+   if (threads <= 0)
+      threads = sysconf (_SC_NPROCESSORS_ONLN);
+   if (threads > 1)
+   {
+      FILE *fp = fopen (filename, "r");
+      if (!fp)
+         return NULL;
+      size_t len;
+      const char *xml = map_file (fileno (fp), &len);
+      if (xml)
+      {
+         xml_t tree = xml_parse_parallel (filename, (const unsigned char *) xml, len, threads);
+         munmap ((void *) xml, len);
+         fclose (fp);
+         return tree;
+      }
+      fclose (fp);
+   }
+#else
+   threads = threads;
+#endif
+   return xml_tree_read_file (filename);
+}
+
 xml_pi_t
 xml_pi_next (xml_t parent, xml_pi_t prev)
 {
@@ -2677,10 +5860,10 @@ xml_pi_add_l (xml_t t, int namel, const char *name, int contentl, const char *co
       errx (1, "Null PI name (xml_pi_add)");
    if (!content)
       errx (1, "Null PI content (xml_pi_add)");
-   xml_pi_t p = xml_alloc (sizeof (*p));
+   xml_pi_t p = xml_alloc_t (t->tree, sizeof (*p));
    p->tree = t->tree;
-   p->name = xml_dup_l (namel, name);
-   p->content = xml_dup_l (contentl, content);
+   p->name = xml_dup_t (p->tree, namel, name);
+   p->content = xml_dup_t (p->tree, contentl, content);
    if (t->tree->first_pi)
       t->tree->last_pi->next = p;
    else
@@ -2703,7 +5886,11 @@ xml_element_set_namespace (xml_t e, xml_namespace_t ns)
 {
    if (!e)
       errx (1, "Null element (xml_element_set_namespace)");
+   if (e->tree->index)
+      index_element (e, 0);
    e->namespace = ns;
+   if (e->tree->index)
+      index_element (e, 1);
 }
 
 void
@@ -2719,8 +5906,18 @@ xml_element_set_name (xml_t e, const char *name)
       e->json_single = 0;
    if (!*name)
       return;
-   xml_free (e->name);
-   e->name = xml_dup (name);
+   xml_name_t n = name_intern (e->tree, strlen (name), name);
+   if (n == e->name)
+      return;
+   if (e->parent && e->parent->indexed)
+      children_remove (e->parent, e);
+   if (e->tree->index)
+      index_element (e, 0);
+   e->name = n;
+   if (e->parent && e->parent->indexed)
+      children_add (e->parent, e, 0);
+   if (e->tree->index)
+      index_element (e, 1);
 }
 
 void
@@ -2728,8 +5925,8 @@ xml_element_set_content_l (xml_t e, int contentl, const char *content)
 {
    if (!e)
       errx (1, "Null element (xml_element_set_content)");
-   xml_free (e->content);
-   e->content = xml_dup_l (contentl, content);
+   xml_free_s (e->tree, e->content);
+   e->content = xml_dup_t (e->tree, contentl, content);
 }
 
 void
@@ -2981,31 +6178,31 @@ xml_attribute_printf_ns (xml_t e, xml_namespace_t namespace, const char *name, c
    if (!e)
       errx (1, "Null element (xml_attribute_printf_ns)");
    // see if exists
-   xml_attribute_t a = e->first_attribute;
-   while (a && ((a->namespace != namespace && (namespace || a->namespace != e->namespace)) || (name && strcmp (a->name, name))))
-      a = a->next;
+   name = name_intern (e->tree, strlen (name), name);
+   xml_attribute_t a = attribute_find (e, namespace, (xml_name_t) name);
    va_list ap;
    va_start (ap, format);
-   xml_content_t new = xml_dup (xml_vsprintf (format, ap));
+   char *v = xml_vsprintf (format, ap);
    va_end (ap);
+   xml_content_t new = xml_dup_t (e->tree, strlen (v ? : ""), v);
+   free (v);
    if (a)
-      xml_free (a->content);
-   else
+   {
+      if (e->tree->index)
+         index_attribute (a, 0);
+      xml_free_s (e->tree, a->content);
+   } else
    {
       // new attribute
-      a = xml_alloc (sizeof (*a));
-      a->parent = e;
-      if (e->first_attribute)
-         e->last_attribute->next = a;
-      else
-         e->first_attribute = a;
-      a->prev = e->last_attribute;
-      e->last_attribute = a;
-      a->name = xml_dup (name);
+      a = xml_alloc_t (e->tree, sizeof (*a));
+      a->name = (char *) name;
       if (namespace)
          a->namespace = namespace;
+      attribute_link (e, a);
    }
    a->content = new;
+   if (e->tree->index)
+      index_attribute (a, 1);
    return a;
 }
 
@@ -3016,9 +6213,11 @@ xml_element_printf_content (xml_t e, const char *format, ...)
       errx (1, "Null element (xml_element_printf_content)");
    va_list ap;
    va_start (ap, format);
-   xml_free (e->content);
-   e->content = xml_dup (xml_vsprintf (format, ap));
+   char *v = xml_vsprintf (format, ap);
    va_end (ap);
+   xml_free_s (e->tree, e->content);
+   e->content = xml_dup_t (e->tree, strlen (v ? : ""), v);
+   free (v);
 }
 
 // Generic shortcut for generating XML, usually #defined as just X or xml in the app
@@ -3642,47 +6841,18 @@ xml_curl (void *curlv, const char *soapaction, xml_t input, const char *url, ...
 void
 xml_curl_cb (void *curlv, xml_callback_t * cb, const char *soapaction, xml_t input, const char *url, ...)
 {                               // Post (if tree supplied) or Get a URL and collect responses - using callback for each complete response as arrives
-   // Note this does not yet handle PI at start, expects sequence of XML objects only, calling back for each as received
    CURL *curl = curlv;
    if (!curl)
    {
       curl = curl_easy_init ();
       curl_easy_setopt (curl, CURLOPT_TIMEOUT, 3600L);  // Assume a hanging get
    }
-#ifdef	EXPAT
-   xml_parser_t parser = {
-   };
-   parser.callback = cb;
-   XML_Parser xml_parser = XML_ParserCreate (0);
-   parser.parser = xml_parser;
-   XML_SetUserData (xml_parser, &parser);
-   XML_SetElementHandler (xml_parser, parse_element_start, parse_element_end);
-   XML_SetCharacterDataHandler (xml_parser, parse_character_data);
-   XML_SetProcessingInstructionHandler (xml_parser, parse_pi);
-   XML_Parse (xml_parser, "<xml>", 5, 0);       // wrap multiple instances - messy
-   xml_tree_delete (parser.tree->root);
-   parser.tree = NULL;
-   parser.here = NULL;
-   int start = 1;
+   xml_parser_t parser = xml_parser_new (NULL, cb);
    size_t write_callback (char *ptr, size_t size, size_t nmemb, void *userdata)
    {
-      size_t len = size * nmemb;
-      if (start && len > 2 && *ptr == '<' && ptr[1] == '?')
-      {                         // Lets hope whole declaration in one block - this is a bodge
-         while (len-- && *ptr++ != '>');
-      }
-      start = 0;
-      if (!XML_Parse (xml_parser, ptr, len, 0))
-      {
-         warnx ("Parse failed at %d:%d %s", (int) XML_GetCurrentLineNumber (xml_parser) + parser.line_offset,
-                (int) XML_GetCurrentColumnNumber (xml_parser), XML_ErrorString (XML_GetErrorCode (xml_parser)));
-         if (parser.tree)
-            xml_tree_delete (parser.tree->root);
-         parser.tree = NULL;
-      }
+      xml_parser_feed (userdata, ptr, size * nmemb);
       return size * nmemb;
    }
-#endif
    char *request = NULL;
    size_t requestlen = 0;
    char *fullurl = NULL;
@@ -3692,12 +6862,8 @@ xml_curl_cb (void *curlv, xml_callback_t * cb, const char *soapaction, xml_t inp
       errx (1, "malloc at line %d", __LINE__);
    va_end (ap);
    curl_easy_setopt (curl, CURLOPT_URL, fullurl);
-#ifdef	EXPAT
-   curl_easy_setopt (curl, CURLOPT_WRITEDATA, &parser);
+   curl_easy_setopt (curl, CURLOPT_WRITEDATA, parser);
    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, write_callback);
-#else
-   errx (1, "Change to curl in to memory and parse");
-#endif
    struct curl_slist *headers = NULL;
    if (input)
    {                            // posting XML input
@@ -3720,18 +6886,7 @@ xml_curl_cb (void *curlv, xml_callback_t * cb, const char *soapaction, xml_t inp
       curl_easy_setopt (curl, CURLOPT_POSTFIELDSIZE, (long) requestlen);
    }                            // if not input, then assume a GET or args preset before call
    CURLcode result = curl_easy_perform (curl);
-#ifdef	EXPAT
-   if (parser.tree)
-   {
-      xml_tree_delete (parser.tree->root);
-      parser.tree = NULL;
-      warnx ("Parse incomplete");
-   }
-   XML_ParserFree (xml_parser);
-#else
-   errx (1, "Finish curl");
-#error CURL CB not donw
-#endif
+   xml_parser_finish (parser);
    // Put back to GET as default
    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, NULL);
    curl_easy_setopt (curl, CURLOPT_HTTPGET, 1L);
@@ -3821,7 +6976,8 @@ main (int argc, char *argv[])
      json = 0,
       jsonout = 0,
       pretty = 0,
-      tidy = 0;
+      tidy = 0,
+      threads = 1;
    const char *attr = NULL;
    // TODO change to popt
    for (a = 1; a < argc; a++)
@@ -3831,6 +6987,11 @@ main (int argc, char *argv[])
          attr = argv[a] + 7;
          continue;
       }
+      if (!strncmp (argv[a], "--threads=", 10))
+      {                         // Parallel parse
+         threads = atoi (argv[a] + 10);
+         continue;
+      }
       if (!strcmp (argv[a], "-j") || !strcmp (argv[a], "--json"))
       {
          json = 1;
@@ -3878,6 +7039,8 @@ main (int argc, char *argv[])
 #endif
          else if (json)
             t = xml_tree_read_file_json (argv[a]);
+         else if (threads != 1)
+            t = xml_tree_read_file_parallel (argv[a], threads);
          else
             t = xml_tree_read_file (argv[a]);
       }
@@ -25,7 +25,7 @@
 #define	AXL_H
 // Parser, object management and output
 
-// Requires -lexpat -lcurl if not axllight
+// Requires -lexpat -lcurl if not axllight, and -pthread
 
 // Types
 
@@ -38,13 +38,11 @@ typedef struct xml_pi_s *xml_pi_t;
 typedef struct xml_attribute_s *xml_attribute_t;
 typedef struct xml_root_s *xml_root_t;
 typedef struct xml_s *xml_t;
-typedef struct xml_stringlist_s *xml_stringlist_t;
-
-struct xml_stringlist_s {
-   xml_stringlist_t next;
-   char *string;
-   int length;
-};
+typedef struct xml_arena_s *xml_arena_t;
+typedef struct xml_intern_s *xml_intern_t;
+typedef struct xml_map_s *xml_map_t;
+typedef struct xml_index_s *xml_index_t;
+typedef const struct xml_name_id_s *xml_name_id_t;      // Name interned in one tree by xml_intern(), compared as a pointer
 
 struct xml_namespace_s {
    int count;                   // Count of usage (i.e. element or explicit attribute)
@@ -61,6 +59,7 @@ struct xml_namespacelist_s {
    xml_namespacelist_t next;
    xml_namespace_t namespace;
    char *tag;
+   xml_namespacelist_t hash;    // Next in hash chain
 };
 
 struct xml_pi_s {
@@ -85,28 +84,42 @@ struct xml_root_s {
    xml_t root;
    xml_namespacelist_t namespacelist,
     namespacelist_end;
+   xml_namespacelist_t *nshash; // Name spaces hashed by URI
+   int nshashn,                 // Size of nshash, power of 2
+    namespaces;                 // Count of namespacelist
    xml_pi_t first_pi,
     last_pi;
    char *encoding;
-   xml_stringlist_t strings;
+   char *buffer;                // In-situ parse buffer, owned by tree, which names and content may point in to
+   size_t bufferlen;
+   xml_arena_t arena;           // If set, the tree, its elements, attributes, PIs and name spaces are allocated in these chunks
+   xml_arena_t arenatext;       // and its strings in these
+   xml_intern_t *intern;        // Element and attribute names, name space tags and file names, hashed, each stored once per tree
+   int internn,                 // Size of intern, power of 2
+    interned;                   // Count of names in intern
+   xml_index_t index;           // Key indexes, see xml_index_build
+   xml_map_t children;          // Children indexes of elements with many children, by element
+   xml_map_t attributes;        // Attribute hashes of elements with many attributes, by element
 };
 
-struct xml_s {
+struct xml_s {                  // Fields used when walking and matching first, so in the same cache line
    xml_t parent;
-   xml_t prev,
-    next;
-   xml_t first_child,
-    last_child;
-   xml_attribute_t first_attribute,
-    last_attribute;
+   xml_t next,
+    first_child;
    xml_namespace_t namespace;
    xml_name_t name;
+   xml_attribute_t first_attribute;
    xml_content_t content;
    xml_root_t tree;
-   int line;
+   xml_t prev,
+    last_child;
+   xml_attribute_t last_attribute;
    const char *filename;
+   int line;
    unsigned char json_single:1; // Output in JSON not as an array - i.e. only ever one instance of this object
    unsigned char json_unquoted:1;       // content not quoted in json
+   unsigned char indexed:1;     // Children indexed by name, in the tree's children, built when a scan by name is long
+   unsigned char hashed:1;      // Attributes hashed by name, in the tree's attributes, built when a scan of them is long
 };
 
 // Functions
@@ -131,6 +144,17 @@ xml_t xml_element_next(xml_t parent, xml_t prev);
 #define		xml_element_next_by_name(p,e,n) xml_element_next_by_name_ns(p,e,NULL,n)
 xml_t xml_element_next_by_name_ns(xml_t parent, xml_t prev, xml_namespace_t namespace, const char *name);
 xml_attribute_t xml_attribute_next(xml_t e, xml_attribute_t prev);
+int xml_element_child_count(xml_t e);
+int xml_element_child_count_by_name_ns(xml_t e, xml_namespace_t namespace, const char *name);
+#define		xml_element_child_count_by_name(e,n)	xml_element_child_count_by_name_ns(e,NULL,n)
+xml_t xml_element_child_at(xml_t e, int n);
+xml_name_id_t xml_intern(xml_t tree, const char *name);
+xml_t xml_element_by_name_ns_id(xml_t e, xml_namespace_t namespace, xml_name_id_t id);
+#define		xml_element_by_name_id(e,i)	xml_element_by_name_ns_id(e,NULL,i)
+xml_attribute_t xml_attribute_by_name_ns_id(xml_t e, xml_namespace_t namespace, xml_name_id_t id);
+#define		xml_attribute_by_name_id(e,i)	xml_attribute_by_name_ns_id(e,NULL,i)
+xml_t xml_element_next_by_name_ns_id(xml_t parent, xml_t prev, xml_namespace_t namespace, xml_name_id_t id);
+#define		xml_element_next_by_name_id(p,e,i) xml_element_next_by_name_ns_id(p,e,NULL,i)
 
 xml_t xml_element_add_ns_after_l(xml_t parent, xml_namespace_t namespace, int namel, const char *name, xml_t prev);
 xml_t xml_element_add_ns_after(xml_t parent, xml_namespace_t namespace, const char *name, xml_t prev);
@@ -155,6 +179,7 @@ void xml_element_set_content_l(xml_t e, int contentl, const char *content);
 void xml_element_set_content(xml_t e, const char *content);
 void xml_element_printf_content(xml_t e, const char *format, ...);
 xml_t xml_tree_new(const char *name);   // Create new tree with dummy root (optionalal naming root)
+xml_t xml_tree_new_arena(const char *name);     // As xml_tree_new, but allocating in large chunks freed only when the tree is deleted
 xml_t xml_tree_add_root_ns(xml_t tree, xml_namespace_t namespace, const char *name);    // Sets root name and namespace and returns root
 #define		xml_tree_add_root(t,n)	xml_tree_add_root_ns(t,NULL,n)
 xml_namespace_t xml_namespace_l(xml_t tree, int tagl, const char *tag, unsigned int namespacel, const char *namespace);
@@ -173,14 +198,44 @@ void xml_quoted(FILE *, const char *);
 #define		xml_write(f,t)	xml_element_write(f,t,1,0)      // fmemopen to write to memory
 #define		xml_write_json(f,t)	xml_element_write_json(f,t)     // fmemopen to write to memory
 xml_t xml_tree_parse(const char *xml);
+xml_t xml_tree_parse_insitu(char *xml, size_t len);     // Parse malloced buffer, which is then owned by tree (or freed on error) and strings left in place where possible
+xml_t xml_tree_parse_select(const char *xml, const char **paths);        // As xml_tree_parse, only keeping elements on the xml_get style paths (NULL terminated list, see docs)
 xml_t xml_tree_parse_json(const char *json, const char *rootname);
 xml_t xml_tree_read(FILE * fp);
 xml_t xml_tree_read_json(FILE * fp, const char *rootname);
-xml_t xml_tree_read_file(const char *filename);
+xml_t xml_tree_read_file(const char *filename);        // Regular files are mapped, not read, truncating the file while parsing gives SIGBUS (see docs)
+xml_t xml_tree_read_file_parallel(const char *filename, int threads);  // As xml_tree_read_file, children of root parsed on threads (0 for one per CPU)
+xml_t xml_tree_read_file_select(const char *filename, const char **paths);       // As xml_tree_read_file, only keeping elements on the xml_get style paths (NULL terminated list, see docs)
 xml_t xml_tree_read_file_json(const char *filename);
+void xml_max_depth(int depth);   // Limit nesting of elements when parsing XML, deeper documents fail to parse (0, the default, for no limit)
 xml_t xml_curl(void *curl, const char *soapaction, xml_t, const char *url, ...);        // Post XML (if tree supplied) or Get a URL and collect response. curl is expected to be initialised and can be set for posting data using curl_formadd and called with no input. URL can be vsprint. Response can be XML or JSON
 typedef void xml_callback_t(xml_t);     // call back
 void xml_curl_cb(void *curlv, xml_callback_t * cb, const char *soapaction, xml_t input, const char *url, ...);  // Parse sequence of responses via callback
+typedef struct xml_parser_s *xml_parser_t;
+xml_parser_t xml_parser_new(const char *filename, xml_callback_t * cb); // Start parsing data fed in parts. If cb set it is called with each of a sequence of documents, which is then deleted
+int xml_parser_feed(xml_parser_t, const void *data, size_t len);        // Parse more data, returns non zero if parse failed (error reported)
+xml_t xml_parser_finish(xml_parser_t);  // End of data, returns tree (NULL if failed, empty or using cb) and frees parser
+typedef struct xml_parse_ctx_s *xml_parse_ctx_t;        // Parser reused for a series of documents, keeping its working storage
+xml_parse_ctx_t xml_parse_ctx_new(void);
+xml_t xml_parse_ctx_parse(xml_parse_ctx_t, const char *xml);   // As xml_tree_parse
+xml_t xml_parse_ctx_read(xml_parse_ctx_t, FILE * fp);  // As xml_tree_read
+void xml_parse_ctx_arena(xml_parse_ctx_t, int arena);  // Set if trees are to be allocated in an arena, as xml_tree_new_arena
+void xml_parse_ctx_reset(xml_parse_ctx_t);     // Free working storage, e.g. after an unusually large document, context can still be used
+void xml_parse_ctx_free(xml_parse_ctx_t);
+typedef struct xml_reader_s *xml_reader_t;     // Pull reader (not in EXPAT build), never builds the whole tree
+#define	XML_READER_START	1       // Start of element, which has its name, namespace and attributes
+#define	XML_READER_END		2       // End of element
+#define	XML_READER_TEXT		3       // Text within an element
+#define	XML_READER_PI		4       // PI (or !DOCTYPE)
+xml_reader_t xml_reader_new(FILE * fp, const char *filename);   // Start pull reading a file, filename used in errors
+int xml_reader_next(xml_reader_t);      // Next XML_READER_ event, 0 at end, -1 if parse failed (error reported)
+xml_t xml_reader_element(xml_reader_t); // Element at START/END, or containing TEXT. Only valid until next event, parents are the open elements
+const char *xml_reader_text(xml_reader_t);      // Text at TEXT (text is split around child elements and PIs)
+xml_pi_t xml_reader_pi(xml_reader_t);   // PI at PI
+int xml_reader_depth(xml_reader_t);     // Depth of element (root is 1) or of element containing TEXT or PI
+xml_t xml_reader_subtree(xml_reader_t); // At START, parse rest of element and return it as root of new tree, to be deleted by caller. Its END is not reported
+void xml_reader_free(xml_reader_t);     // Free reader, does not close file
+int xml_tree_read_each(FILE * fp, int depth, xml_callback_t * cb);      // Call cb with each element at depth (root is 1) as root of its own tree, which is then deleted. Returns count, or -1 if parse failed (not in EXPAT build)
 void xml_log(int debug, const char *who, const char *what, xml_t tx, xml_t rx);
 
 // General conversions common to xml
@@ -238,5 +293,9 @@ xml_t xml_addf(xml_t e, const char *path, const char *fmt, ...);
 // Similar generic path based functions
 xml_t xml_find(xml_t e, const char *path);      // return an element using a path
 char *xml_get(xml_t, const char *path); // return content of element or attribute using a path (attribute as final part)
+// Index of elements on a path by the value of a key attribute, kept up to date as the tree changes, freed with the tree
+xml_index_t xml_index_build(xml_t tree, const char *path, const char *key);    // path as xml_get from root, * for any name, NULL for any element
+xml_t xml_index_get(xml_index_t, const char *value);   // return element with key attribute value, the first indexed if more than one
+void xml_index_free(xml_index_t);
 
 #endif                          // AXL_H
@@ -0,0 +1,67 @@
+// Time per attribute to build an element by xml_attribute_set and to look each attribute up, for a range of attribute counts
+// e.g. bench/attrcount 1000000, the total attributes set for each count
+
+#include "bench.h"
+
+static int n,                   // Attributes per element
+  rounds;                       // Elements, timed together so the clock is not read per element
+static char (*names)[16];
+static xml_t *trees;
+
+static void
+build (void)
+{
+   int r,
+     i;
+   for (r = 0; r < rounds; r++)
+   {
+      trees[r] = xml_tree_new ("root");
+      for (i = 0; i < n; i++)
+         xml_attribute_set (trees[r], names[i], "value");
+   }
+}
+
+static void
+lookup (void)
+{
+   int r,
+     i;
+   for (r = 0; r < rounds; r++)
+      for (i = 0; i < n; i++)
+         if (!xml_attribute_by_name (trees[r], names[i]))
+            errx (1, "Missing %s", names[i]);
+}
+
+static void
+delete (void)
+{
+   int r;
+   for (r = 0; r < rounds; r++)
+      xml_tree_delete (trees[r]);
+}
+
+int
+main (int argc, const char *argv[])
+{
+   int total = argc > 1 ? atoi (argv[1]) : 1000000;
+   static const int counts[] = { 4, 16, 32, 64, 300, 1000, 0 };
+   int c;
+   for (c = 0; counts[c]; c++)
+   {
+      n = counts[c];
+      rounds = total / n;
+      names = malloc (sizeof (*names) * n);
+      trees = malloc (sizeof (*trees) * rounds);
+      if (!names || !trees)
+         errx (1, "malloc at line %d", __LINE__);
+      int i;
+      for (i = 0; i < n; i++)
+         sprintf (names[i], "attr%d", i);
+      double b = bench_best (3, bench_cpu, NULL, build, delete),
+         l = bench_best (3, bench_cpu, build, lookup, delete);
+      printf ("%5d attrs  build %5.0f ns  lookup %5.0f ns\n", n, b * 1e9 / rounds / n, l * 1e9 / rounds / n);
+      free (names);
+      free (trees);
+   }
+   return 0;
+}
@@ -0,0 +1,48 @@
+// Parse time of an attribute heavy document, e.g. bench/attributes 50000 31
+// Elements with many attributes, some values needing decoding
+
+#include "bench.h"
+
+static int attributes;
+static char *xml;
+static xml_t tree;
+
+static void
+record (FILE * f, int e)
+{
+   fprintf (f, "<item");
+   int a;
+   for (a = 0; a < attributes; a++)
+      if (a % 8 == 7)
+         fprintf (f, " x:a%d=\"%d &amp; caf\xC3\xA9\"", a, e + a);
+      else
+         fprintf (f, " a%d=\"value-%d\"", a, e + a);
+   fprintf (f, "/>\n");
+}
+
+static void
+parse (void)
+{
+   if (!(tree = xml_tree_parse (xml)))
+      errx (1, "Parse failed");
+}
+
+static void
+delete (void)
+{
+   xml_tree_delete (tree);
+}
+
+int
+main (int argc, const char *argv[])
+{
+   int elements = argc > 1 ? atoi (argv[1]) : 50000;
+   attributes = argc > 2 ? atoi (argv[2]) : 31;
+   size_t len;
+   xml = bench_doc (&len, "<root xmlns:x=\"urn:x\">", elements, record);
+   double p = bench_best (3, bench_cpu, NULL, parse, delete),
+      d = bench_best (3, bench_cpu, parse, delete, NULL);
+   printf ("%d elements, %d attributes, %.1fMB: parse %.3fs, delete %.3fs\n", elements, attributes, len / 1e6, p, d);
+   free (xml);
+   return 0;
+}
@@ -0,0 +1,61 @@
+// Shared by the benchmarks in bench/, each a program built by make bench
+// Timing state is kept in the program's statics, so the run functions take no arguments
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "axl.h"
+
+static inline double
+bench_cpu (void)
+{                               // CPU seconds
+   struct timespec t;
+   clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &t);
+   return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static inline double
+bench_wall (void)
+{                               // Wall clock seconds, for work spread over threads
+   struct timespec t;
+   clock_gettime (CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static inline char *
+bench_doc (size_t * lenp, const char *root, int records, void (*record) (FILE *, int))
+{                               // Document made in memory, XML declaration, root STag, each record, root ETag
+   char *xml;
+   FILE *f = open_memstream (&xml, lenp);
+   if (!f)
+      err (1, "open_memstream");
+   fprintf (f, "<?xml version=\"1.0\"?>\n%s\n", root);
+   int r;
+   for (r = 0; r < records; r++)
+      record (f, r);
+   fprintf (f, "</%.*s>\n", (int) strcspn (root + 1, " >"), root + 1);
+   fclose (f);
+   return xml;
+}
+
+static inline double
+bench_best (int runs, double (*clock) (void), void (*setup) (void), void (*run) (void), void (*cleanup) (void))
+{                               // Best time of run over runs, setup and cleanup (if not NULL) are not timed
+   double best = 0;
+   int n;
+   for (n = 0; n < runs; n++)
+   {
+      if (setup)
+         setup ();
+      double a = clock ();
+      run ();
+      double b = clock ();
+      if (cleanup)
+         cleanup ();
+      if (!n || b - a < best)
+         best = b - a;
+   }
+   return best;
+}
@@ -0,0 +1,59 @@
+// Per message parse time, xml_tree_parse against a reused xml_parse_ctx, e.g. bench/ctx 200000
+// Each message is parsed and its tree deleted, as a server handling a stream of small requests would
+
+#include "bench.h"
+
+static const char *messages[] = {
+   "<a/>",
+   "<?xml version=\"1.0\"?>\n"
+      "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" xmlns:m=\"urn:example:orders\">"
+      "<s:Header><m:MessageID>6f9619ff-8b86-d011-b42d-00c04fc964ff</m:MessageID><m:Sent>2024-01-01T12:00:00Z</m:Sent></s:Header>"
+      "<s:Body><m:Order id=\"12345\" priority=\"high\"><m:Customer>Alice &amp; Bob</m:Customer>"
+      "<m:Item sku=\"A-1\" qty=\"2\"/><m:Item sku=\"B-22\" qty=\"1\"/><m:Note>Leave at the door</m:Note></m:Order></s:Body>"
+      "</s:Envelope>",
+   NULL
+};
+
+static int count;
+static const char *xml;
+static xml_parse_ctx_t ctx;     // NULL for xml_tree_parse
+
+static void
+parse (void)
+{
+   int n;
+   for (n = 0; n < count; n++)
+   {
+      xml_t t = ctx ? xml_parse_ctx_parse (ctx, xml) : xml_tree_parse (xml);
+      if (!t)
+         errx (1, "Parse failed");
+      xml_tree_delete (t);
+   }
+}
+
+int
+main (int argc, const char *argv[])
+{
+   count = argc > 1 ? atoi (argv[1]) : 200000;
+   int m;
+   for (m = 0; messages[m]; m++)
+   {
+      xml = messages[m];
+      int mode;
+      for (mode = 0; mode < 3; mode++)
+      {                         // xml_tree_parse, context, context with arena
+         ctx = NULL;
+         if (mode)
+         {
+            ctx = xml_parse_ctx_new ();
+            xml_parse_ctx_arena (ctx, mode == 2);
+         }
+         double best = bench_best (3, bench_cpu, NULL, parse, NULL);
+         if (ctx)
+            xml_parse_ctx_free (ctx);
+         printf ("%zu byte message, %-21s %.3fus\n", strlen (xml),
+                 mode == 0 ? "xml_tree_parse:" : mode == 1 ? "xml_parse_ctx:" : "xml_parse_ctx arena:", best * 1e6 / count);
+      }
+   }
+   return 0;
+}
@@ -0,0 +1,50 @@
+// Read time of a large file on 1, 2, 4 and 8 threads, e.g. bench/parallel 1000000
+// The document is written to a temporary file: many records under the root, with attributes, text and a name space
+
+#include <unistd.h>
+#include "bench.h"
+
+static char filename[] = "/tmp/axl-parallel-XXXXXX";
+static int threads;
+static xml_t tree;
+
+static void
+record (FILE * f, int r)
+{
+   fprintf (f,
+            "<record id=\"%d\" x:type=\"t%d\"><name>Record &amp; %d</name><value>%d</value><x:note>Some text to make it longer</x:note></record>\n",
+            r, r % 7, r, r * 3);
+}
+
+static void
+read_file (void)
+{
+   if (!(tree = xml_tree_read_file_parallel (filename, threads)))
+      errx (1, "Parse failed");
+}
+
+static void
+delete (void)
+{
+   xml_tree_delete (tree);
+}
+
+int
+main (int argc, const char *argv[])
+{
+   int records = argc > 1 ? atoi (argv[1]) : 1000000;
+   size_t len;
+   char *xml = bench_doc (&len, "<root xmlns:x=\"urn:x\">", records, record);
+   int fd = mkstemp (filename);
+   if (fd < 0)
+      err (1, "mkstemp");
+   if (write (fd, xml, len) != (ssize_t) len)
+      err (1, "write");
+   close (fd);
+   free (xml);
+   for (threads = 1; threads <= 8; threads *= 2)
+      printf ("%d records, %.1fMB, %d thread%s: %.3fs\n", records, len / 1e6, threads, threads == 1 ? "" : "s",
+              bench_best (3, bench_wall, NULL, read_file, delete));
+   unlink (filename);
+   return 0;
+}
@@ -0,0 +1,61 @@
+// Time to walk every element and attribute of a parsed tree, malloc and arena, e.g. bench/traverse 200000
+// Records with a few attributes and children, with some text
+
+#include "bench.h"
+
+static xml_t tree;
+static size_t visited;
+
+static void
+record (FILE * f, int r)
+{
+   fprintf (f,
+            "<record id=\"%d\" type=\"t%d\" state=\"ok\"><name>Record %d</name><value unit=\"s\">%d</value><list><item/><item/><item/></list></record>\n",
+            r, r % 7, r, r * 3);
+}
+
+static void
+walk (void)
+{                               // Visit every element in document order, touching what a search would
+   size_t n = 0;
+   xml_t e = tree;
+   while (e)
+   {
+      n += (e->name && *e->name) + (e->content && *e->content);
+      xml_attribute_t a;
+      for (a = e->first_attribute; a; a = a->next)
+         n += (*a->name == 'i');
+      if (e->first_child)
+         e = e->first_child;
+      else
+      {
+         while (e && e != tree && !e->next)
+            e = e->parent;
+         e = (e && e != tree) ? e->next : NULL;
+      }
+   }
+   visited = n;
+}
+
+int
+main (int argc, const char *argv[])
+{
+   int records = argc > 1 ? atoi (argv[1]) : 200000;
+   size_t len;
+   char *xml = bench_doc (&len, "<root>", records, record);
+   printf ("sizeof (struct xml_s) %zu, %d records, %.1fMB\n", sizeof (struct xml_s), records, len / 1e6);
+   int arena;
+   for (arena = 0; arena < 2; arena++)
+   {
+      xml_parse_ctx_t c = xml_parse_ctx_new ();
+      xml_parse_ctx_arena (c, arena);
+      if (!(tree = xml_parse_ctx_parse (c, xml)))
+         errx (1, "Parse failed");
+      double best = bench_best (5, bench_cpu, NULL, walk, NULL);
+      printf ("%s tree: walk %.3fs (%zu)\n", arena ? "Arena" : "Malloc", best, visited);
+      xml_tree_delete (tree);
+      xml_parse_ctx_free (c);
+   }
+   free (xml);
+   return 0;
+}